@@ -0,0 +1,96 @@
+// BlockSetBench.cpp
+// Copyright (c) 2014 Jinglei Ren <jinglei.ren@stanzax.org>
+//
+// Compares BlockSet with std::unordered_set<uint64_t> on the work of an
+// epoch engine: inserting written blocks until an epoch has a given number
+// of dirty blocks, visiting them, and clearing the set for the next epoch.
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <unordered_set>
+#include <vector>
+#include "block_set.h"
+
+#define MEGA 1000000
+
+using namespace std;
+
+// Blocks written by a mix of sequential runs over a heap and random hits,
+// each block written a few times in a row.
+static vector<uint64_t> MakeWrites(uint64_t num_writes) {
+  vector<uint64_t> writes;
+  writes.reserve(num_writes);
+  uint64_t seq = 0x10000000;
+  srand(1);
+  while (writes.size() < num_writes) {
+    const uint64_t block = (rand() % 4) ? seq++ :
+        0x20000000 + ((uint64_t)rand() << 8 | rand() % 256) % (1 << 26);
+    for (int i = 0; i < 4 && writes.size() < num_writes; ++i) {
+      writes.push_back(block);
+    }
+  }
+  return writes;
+}
+
+// Returns nanoseconds per write, and the sum of visited blocks as a check.
+template <typename Set>
+static double Run(const vector<uint64_t>& writes, size_t epoch_blocks,
+    uint64_t* sum) {
+  chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+  Set blocks;
+  *sum = 0;
+  for (vector<uint64_t>::const_iterator it = writes.begin();
+      it != writes.end(); ++it) {
+    if (blocks.size() == epoch_blocks) {
+      for (typename Set::const_iterator b = blocks.begin(); b != blocks.end();
+          ++b) {
+        *sum += *b;
+      }
+      blocks.clear();
+    }
+    blocks.insert(*it);
+  }
+  chrono::duration<double> span = chrono::steady_clock::now() - begin;
+  return span.count() * 1e9 / writes.size();
+}
+
+int main(int argc, const char* argv[]) {
+  uint64_t num_writes = 20 * MEGA;
+  vector<size_t> epochs;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      num_writes = atoll(argv[++i]) * MEGA;
+    } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+      epochs.push_back(atoi(argv[++i]));
+    } else {
+      cerr << "Usage: " << argv[0] << " [-n MEGA_WRITES] [-e EPOCH_BLOCKS]..."
+          << endl;
+      return EINVAL;
+    }
+  }
+  if (epochs.empty()) {
+    for (size_t n = 512; n <= 65536; n *= 2) epochs.push_back(n);
+  }
+
+  const vector<uint64_t> writes = MakeWrites(num_writes);
+  cout << "# epoch blocks, unordered_set ns/write, BlockSet ns/write, speedup"
+      << endl;
+  for (vector<size_t>::iterator it = epochs.begin(); it != epochs.end();
+      ++it) {
+    uint64_t std_sum, flat_sum;
+    const double std_ns = Run< unordered_set<uint64_t> >(writes, *it,
+        &std_sum);
+    const double flat_ns = Run<BlockSet>(writes, *it, &flat_sum);
+    if (std_sum != flat_sum) {
+      cerr << "[Error] BlockSet visited different blocks." << endl;
+      return EINVAL;
+    }
+    cout << *it << '\t' << std_ns << '\t' << flat_ns << '\t'
+        << std_ns / flat_ns << endl;
+  }
+  return 0;
+}
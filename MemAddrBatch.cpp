@@ -0,0 +1,415 @@
+// MemAddrBatch.cpp
+// Copyright (c) 2014 Jinglei Ren <jinglei.ren@stanzax.org>
+//
+// Runs the analysis of MemAddrStats over many traces, given as files,
+// directories or globs, on a bounded number of threads. A trace is started
+// only while the state estimated for it from its chunk index fits in the
+// memory budget along with the traces being analyzed, in the order given.
+// Besides the .stats files of each trace, tables averaged over all traces
+// are written as <aggregate>-<epoch>-<page bits>.stats.
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <glob.h>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "mem_addr_parser.h"
+#include "epoch_stats.h"
+
+#define MEGA 1000000
+
+using namespace std;
+
+// Bytes of a block in a BlockSet: a slot of 16 bytes at a load of a quarter
+// to a half, and 8 bytes in the dense array
+const uint64_t kBlockBytes = 64;
+// Bytes of a page in the per-page stats of a visitor
+const uint64_t kPageBytes = 64;
+// Bytes of a record decoded or read ahead by a stream
+const uint64_t kRecordBytes = 2 * (2 * sizeof(uint64_t) + sizeof(char));
+
+struct BatchOptions {
+  vector<int> epochs;
+  vector<int> pages;
+  EpochUnit unit;
+  uint64_t ins_begin;
+  uint64_t ins_end;
+};
+
+struct BatchJob {
+  string file;
+  uint64_t bytes; // estimated
+  bool ok;
+  vector<DirtTable> tables;
+};
+
+static bool EndsWith(const string& s, const char* suffix) {
+  const size_t n = strlen(suffix);
+  return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+static bool IsTrace(const string& file) {
+  return EndsWith(file, ".trace") || EndsWith(file, ".manifest");
+}
+
+// Appends the traces named by a file, directory or glob.
+static bool ListTraces(const char* arg, vector<string>* files) {
+  struct stat st;
+  if (strpbrk(arg, "*?[")) {
+    glob_t matches;
+    if (glob(arg, 0, NULL, &matches) != 0) return false;
+    for (size_t i = 0; i < matches.gl_pathc; ++i) {
+      if (IsTrace(matches.gl_pathv[i])) files->push_back(matches.gl_pathv[i]);
+    }
+    globfree(&matches);
+  } else if (stat(arg, &st) == 0 && S_ISDIR(st.st_mode)) {
+    DIR* dir = opendir(arg);
+    if (!dir) return false;
+    vector<string> names;
+    for (dirent* e = readdir(dir); e; e = readdir(dir)) {
+      if (IsTrace(e->d_name)) names.push_back(e->d_name);
+    }
+    closedir(dir);
+    sort(names.begin(), names.end());
+    for (vector<string>::iterator it = names.begin(); it != names.end();
+        ++it) {
+      files->push_back(string(arg) + "/" + *it);
+    }
+  } else {
+    files->push_back(arg);
+  }
+  return true;
+}
+
+// Returns the manifest of a segment named <prefix>.<NNNN>.trace, if any.
+static string ManifestOf(const string& file) {
+  const string base = TraceManifest::SegmentBase(file);
+  if (base.empty()) return string();
+  const string manifest = base + ".manifest";
+  return TraceManifest::IsManifest(manifest.c_str()) ? manifest : string();
+}
+
+// Drops repeated traces and the segments of manifests, which stand for
+// them, so that a segmented trace is analyzed as a whole.
+static vector<string> UniqueTraces(vector<string> files) {
+  set<string> paths;
+  set<string> segments;
+  const size_t num_files = files.size();
+  for (size_t i = 0; i < num_files; ++i) {
+    const string manifest = ManifestOf(files[i]);
+    if (!manifest.empty()) files.push_back(manifest);
+  }
+  for (vector<string>::const_iterator it = files.begin(); it != files.end();
+      ++it) {
+    vector<string> listed;
+    if (!TraceManifest::IsManifest(it->c_str()) ||
+        !MemAddrParser::ListSegments(it->c_str(), &listed)) continue;
+    for (vector<string>::iterator s = listed.begin(); s != listed.end();
+        ++s) {
+      char path[PATH_MAX];
+      if (realpath(s->c_str(), path)) segments.insert(path);
+    }
+  }
+  vector<string> unique;
+  for (vector<string>::const_iterator it = files.begin(); it != files.end();
+      ++it) {
+    char path[PATH_MAX];
+    const string key = realpath(it->c_str(), path) ? path : *it;
+    if (segments.count(key) || !paths.insert(key).second) continue;
+    unique.push_back(*it);
+  }
+  return unique;
+}
+
+// Estimates the peak bytes of analyzing a trace on a single thread: a chunk
+// of records of each thread, and for each engine the blocks of an epoch,
+// those dirtied overall, and the pages dirtied at each size. Blocks are
+// bounded by the writes and by the address ranges of the chunks with them.
+// Without an index, a byte of the trace is taken for a write.
+static uint64_t EstimateBytes(const char* file, const BatchOptions& options) {
+  TraceExtent extent;
+  uint64_t blocks = 0;
+  vector<uint64_t> pages(options.pages.size(), 0);
+  uint64_t chunks = 0;
+  if (MemAddrParser::ScanIndex(file, &extent)) {
+    for (vector< pair<uint64_t, uint64_t> >::iterator it =
+        extent.addr_ranges.begin(); it != extent.addr_ranges.end(); ++it) {
+      blocks += (it->second >> CACHE_BLOCK_BITS) -
+          (it->first >> CACHE_BLOCK_BITS) + 1;
+      for (unsigned int i = 0; i < pages.size(); ++i) {
+        pages[i] += (it->second >> options.pages[i]) -
+            (it->first >> options.pages[i]) + 1;
+      }
+    }
+    blocks = min(blocks, extent.num_writes);
+    chunks = (uint64_t)extent.num_threads * extent.buffer_length;
+  } else {
+    vector<string> segments;
+    MemAddrParser::ListSegments(file, &segments);
+    for (vector<string>::iterator it = segments.begin();
+        it != segments.end(); ++it) {
+      struct stat st;
+      if (stat(it->c_str(), &st) == 0) blocks += st.st_size;
+    }
+    pages.assign(pages.size(), blocks);
+  }
+
+  uint64_t bytes = chunks * kRecordBytes;
+  for (vector<int>::const_iterator it = options.epochs.begin();
+      it != options.epochs.end(); ++it) {
+    const uint64_t epoch_blocks = options.unit == kDirtyBlocks ?
+        min((uint64_t)*it, blocks) : blocks;
+    bytes += (epoch_blocks + blocks) * kBlockBytes;
+    for (unsigned int i = 0; i < pages.size(); ++i) {
+      bytes += min(pages[i], blocks) * kPageBytes;
+    }
+  }
+  return bytes;
+}
+
+// Analyzes a trace as MemAddrStats -d 0 -j 0 does, and keeps its tables.
+static void RunJob(const BatchOptions& options, BatchJob* job) {
+  MemAddrParser parser(job->file.c_str(), kWritesOnly, 0);
+  job->ok = !parser.thread_ids().empty();
+  if (!job->ok) return;
+  DirtEpochStats stats(options.epochs, options.pages, options.unit);
+
+  RecordBatch batch;
+  if (options.ins_begin) parser.Seek(options.ins_begin);
+  while (parser.NextBatch(&batch)) {
+    const uint64_t* end = batch.ins_seqs + batch.size;
+    if (end[-1] >= options.ins_end) {
+      batch.size = lower_bound(batch.ins_seqs, end, options.ins_end) -
+          batch.ins_seqs;
+      stats.Input(batch);
+      break;
+    }
+    stats.Input(batch);
+  }
+
+  vector<string> notes;
+  if (options.unit == kInstructions) {
+    notes.push_back("epoch_unit=instructions");
+  }
+  if (options.ins_begin) {
+    notes.push_back("ins_begin=" + to_string(options.ins_begin));
+  }
+  if (parser.filter_line()) {
+    notes.push_back("line_filter=" + to_string(parser.filter_entries()) +
+        "x" + to_string(parser.filter_line()) + "B");
+  }
+  stats.Fill(options.ins_begin, &job->tables);
+  for (vector<DirtTable>::iterator it = job->tables.begin();
+      it != job->tables.end(); ++it) {
+    it->Write(job->file, notes);
+  }
+}
+
+// Starts jobs in order as threads and memory become free. A job larger
+// than the budget runs when no other job does.
+class BatchRunner {
+ public:
+  BatchRunner(const BatchOptions& options, vector<BatchJob>* jobs,
+      uint64_t budget) : options_(options), jobs_(jobs), budget_(budget),
+      next_(0), bytes_(0), running_(0) { }
+
+  void Run(int num_threads) {
+    vector<thread> threads;
+    for (int i = 0; i < num_threads; ++i) {
+      threads.push_back(thread(&BatchRunner::Work, this));
+    }
+    for (vector<thread>::iterator it = threads.begin(); it != threads.end();
+        ++it) {
+      it->join();
+    }
+  }
+
+ private:
+  void Work() {
+    unique_lock<mutex> lock(mutex_);
+    while (true) {
+      while (next_ < jobs_->size() && running_ &&
+          bytes_ + (*jobs_)[next_].bytes > budget_) {
+        free_cond_.wait(lock);
+      }
+      if (next_ == jobs_->size()) return;
+      BatchJob& job = (*jobs_)[next_++];
+      bytes_ += job.bytes;
+      ++running_;
+      lock.unlock();
+
+      chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+      RunJob(options_, &job);
+      chrono::duration<double> span = chrono::steady_clock::now() - begin;
+
+      lock.lock();
+      bytes_ -= job.bytes;
+      --running_;
+      if (job.ok) {
+        cerr << "Analyzed " << job.file << " in " << span.count() << " s"
+            << endl;
+      } else {
+        cerr << "[Error] Failed to analyze " << job.file << endl;
+      }
+      free_cond_.notify_all();
+    }
+  }
+
+  const BatchOptions& options_;
+  vector<BatchJob>* const jobs_;
+  const uint64_t budget_;
+
+  mutex mutex_; // guards all below
+  condition_variable free_cond_;
+  size_t next_; // job to start
+  uint64_t bytes_; // estimated of the jobs running
+  int running_;
+};
+
+// Averages the tables of all traces, each trace weighing the same. Epochs
+// are summed up, and so are instructions for the interval of an epoch.
+static vector<DirtTable> Aggregate(const vector<BatchJob>& jobs) {
+  vector<DirtTable> sums;
+  vector<double> ins;
+  int num_traces = 0;
+  for (vector<BatchJob>::const_iterator job = jobs.begin();
+      job != jobs.end(); ++job) {
+    if (!job->ok) continue;
+    if (!num_traces++) {
+      sums = job->tables;
+      for (unsigned int i = 0; i < sums.size(); ++i) {
+        ins.push_back(sums[i].epoch_ins * sums[i].num_epochs);
+      }
+      continue;
+    }
+    for (unsigned int i = 0; i < sums.size(); ++i) {
+      const DirtTable& table = job->tables[i];
+      DirtTable& sum = sums[i];
+      sum.num_epochs += table.num_epochs;
+      ins[i] += table.epoch_ins * table.num_epochs;
+      for (unsigned int b = 0; b < sum.overall_dirts.size(); ++b) {
+        sum.epoch_cdf[b] += table.epoch_cdf[b];
+        sum.overall_dirts[b] += table.overall_dirts[b];
+        sum.epoch_spans[b] += table.epoch_spans[b];
+      }
+      sum.epoch_cdf.back() += table.epoch_cdf.back();
+    }
+  }
+  for (unsigned int i = 0; i < sums.size(); ++i) {
+    DirtTable& sum = sums[i];
+    sum.epoch_ins = ins[i] / sum.num_epochs;
+    for (unsigned int b = 0; b < sum.overall_dirts.size(); ++b) {
+      sum.epoch_cdf[b] /= num_traces;
+      sum.overall_dirts[b] /= num_traces;
+      sum.epoch_spans[b] /= num_traces;
+    }
+    sum.epoch_cdf.back() /= num_traces;
+  }
+  return sums;
+}
+
+int main(int argc, const char* argv[]) {
+  if (argc < 2 || argv[1][0] == '-') {
+    cerr << "Usage: " << argv[0]
+        << " FILE|DIR|GLOB... [-e EPOCH_INTERVAL]... [-p PAGE_BITS]... [-i]"
+        << " [-b MEGA_INS_BEGIN] [-n MEGA_INS_NUM] [-j JOBS] [-m MEM_MIB]"
+        << " [-o AGGREGATE]" << endl;
+    return EINVAL;
+  }
+
+  vector<string> files;
+  int i = 1;
+  for (; i < argc && argv[i][0] != '-'; ++i) {
+    if (!ListTraces(argv[i], &files)) {
+      cerr << "[Error] Failed to list " << argv[i] << endl;
+      return ENOENT;
+    }
+  }
+
+  BatchOptions options;
+  options.unit = kDirtyBlocks;
+  options.ins_begin = 0;
+  options.ins_end = UINT64_MAX;
+  int num_jobs = thread::hardware_concurrency();
+  // Half of the physical memory unless told otherwise
+  uint64_t budget = (uint64_t)sysconf(_SC_PHYS_PAGES) *
+      sysconf(_SC_PAGE_SIZE) / 2;
+  string aggregate = "aggregate";
+  for (; i < argc; ++i) {
+    const bool has_value = i + 1 < argc;
+    if (strcmp(argv[i], "-e") == 0 && has_value) {
+      options.epochs.push_back(atoi(argv[++i]));
+    } else if (strcmp(argv[i], "-p") == 0 && has_value) {
+      options.pages.push_back(atoi(argv[++i]));
+    } else if (strcmp(argv[i], "-i") == 0) { // epochs of instructions
+      options.unit = kInstructions;
+    } else if (strcmp(argv[i], "-b") == 0 && has_value) {
+      options.ins_begin = atoll(argv[++i]) * MEGA;
+    } else if (strcmp(argv[i], "-n") == 0 && has_value) {
+      options.ins_end = atoll(argv[++i]) * MEGA;
+    } else if (strcmp(argv[i], "-j") == 0 && has_value) {
+      num_jobs = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-m") == 0 && has_value) {
+      budget = (uint64_t)atoll(argv[++i]) << 20;
+    } else if (strcmp(argv[i], "-o") == 0 && has_value) {
+      aggregate = argv[++i];
+    } else {
+      cerr << "[Err] Wrong argument: " << argv[i] << endl;
+      return EINVAL;
+    }
+  }
+  if (options.ins_end != UINT64_MAX) options.ins_end += options.ins_begin;
+  if (num_jobs < 1) num_jobs = 1;
+
+  files = UniqueTraces(files);
+  if (files.empty()) {
+    cerr << "[Error] No traces found." << endl;
+    return ENOENT;
+  }
+  vector<BatchJob> jobs(files.size());
+  for (unsigned int j = 0; j < files.size(); ++j) {
+    jobs[j].file = files[j];
+    jobs[j].bytes = EstimateBytes(files[j].c_str(), options);
+    jobs[j].ok = false;
+    if (jobs[j].bytes > budget) {
+      cerr << "[Warning] " << files[j] << " takes an estimated "
+          << (jobs[j].bytes >> 20) << " MiB, beyond the budget." << endl;
+    }
+  }
+
+  BatchRunner runner(options, &jobs, budget);
+  runner.Run(min<int>(num_jobs, jobs.size()));
+
+  int num_failed = 0;
+  for (vector<BatchJob>::iterator it = jobs.begin(); it != jobs.end(); ++it) {
+    if (!it->ok) ++num_failed;
+  }
+  if (num_failed < (int)jobs.size()) {
+    vector<string> notes;
+    notes.push_back("traces=" + to_string(jobs.size() - num_failed));
+    if (options.unit == kInstructions) {
+      notes.push_back("epoch_unit=instructions");
+    }
+    const vector<DirtTable> tables = Aggregate(jobs);
+    for (vector<DirtTable>::const_iterator it = tables.begin();
+        it != tables.end(); ++it) {
+      it->Write(aggregate, notes);
+    }
+  }
+  cerr << "Analyzed " << jobs.size() - num_failed << " of " << jobs.size()
+      << " traces" << endl;
+  return num_failed ? EIO : 0;
+}
@@ -0,0 +1,133 @@
+// MemAddrBench.cpp
+// Copyright (c) 2014 Jinglei Ren <jinglei.ren@stanzax.org>
+//
+// Measures how MemAddrTrace scales with the number of tracing threads,
+// feeding synthetic records directly to Input without Pin.
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "mem_addr_trace.h"
+
+#define MEGA 1000000
+
+using namespace std;
+
+static mutex g_lock; // emulates the old global lock with -l
+
+struct BenchConfig {
+  uint32_t buf_len;
+  uint64_t num_records; // per thread
+  bool global_lock;
+  int num_buffers; // per thread
+  int num_writers;
+};
+
+// Strided stores and reads over a private region, like a memcpy loop.
+static void Feed(MemAddrTrace* trace, const BenchConfig& config,
+    int tid, int num_threads) {
+  const uint64_t base = ((uint64_t)tid + 1) << 32;
+  for (uint64_t i = 0; i < config.num_records; ++i) {
+    uint64_t ins_seq = i * num_threads + tid;
+    void* addr = (void*)(base + ((i * 8) & 0xfffffff));
+    char op = (i % 3 == 0) ? 'W' : 'R';
+    if (config.global_lock) {
+      lock_guard<mutex> guard(g_lock);
+      BUG_ON(!trace->Input(ins_seq, addr, op));
+    } else {
+      BUG_ON(!trace->Input(ins_seq, addr, op));
+    }
+  }
+}
+
+static double Run(const string& file, const BenchConfig& config,
+    int num_threads, TraceStats* stats) {
+  TraceFile trace_file(config.buf_len, file.c_str(), UINT32_MAX >> 12,
+      config.num_buffers);
+  vector<thread> writers;
+  for (int i = 0; i < config.num_writers; ++i) {
+    writers.push_back(thread(&TraceFile::Run, &trace_file));
+  }
+  vector<MemAddrTrace*> traces;
+  if (config.global_lock) {
+    traces.assign(num_threads, new MemAddrTrace(&trace_file, 0));
+  } else {
+    for (int i = 0; i < num_threads; ++i) {
+      traces.push_back(new MemAddrTrace(&trace_file, i));
+    }
+  }
+
+  chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+  vector<thread> threads;
+  for (int i = 0; i < num_threads; ++i) {
+    threads.push_back(thread(Feed, traces[i], config, i, num_threads));
+  }
+  for (vector<thread>::iterator it = threads.begin(); it != threads.end();
+      ++it) {
+    it->join();
+  }
+  for (int i = 0; i < (config.global_lock ? 1 : num_threads); ++i) {
+    traces[i]->Flush();
+    delete traces[i];
+  }
+  trace_file.Close();
+  chrono::duration<double> span = chrono::steady_clock::now() - begin;
+
+  for (vector<thread>::iterator it = writers.begin(); it != writers.end();
+      ++it) {
+    it->join();
+  }
+  *stats = trace_file.stats();
+  return span.count();
+}
+
+int main(int argc, const char* argv[]) {
+  if (argc < 2) {
+    cerr << "Usage: " << argv[0] << " FILE [-t MAX_THREADS]"
+        << " [-n MEGA_RECORDS_PER_THREAD] [-b BUFFER_LENGTH] [-l]"
+        << " [-k BUFFERS_PER_THREAD] [-w WRITER_THREADS]" << endl;
+    return EINVAL;
+  }
+
+  const string file(argv[1]);
+  int max_threads = thread::hardware_concurrency();
+  BenchConfig config = { 1048576, 16 * MEGA, false, 2, 1 };
+  for (int i = 2; i < argc; ++i) {
+    if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      max_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      config.num_records = atoll(argv[++i]) * MEGA;
+    } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+      config.buf_len = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+      config.num_buffers = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+      config.num_writers = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-l") == 0) {
+      config.global_lock = true;
+    } else {
+      cerr << "[Err] Wrong argument: " << argv[i] << endl;
+      return EINVAL;
+    }
+  }
+
+  cout << "# threads, seconds, M records/s, avg flush ms, stall ms" << endl;
+  for (int t = 1; t <= max_threads; t = (t < max_threads && t * 2 > max_threads)
+      ? max_threads : t * 2) {
+    TraceStats stats;
+    double seconds = Run(file, config, t, &stats);
+    cout << t << '\t' << seconds << '\t'
+        << t * config.num_records / seconds / MEGA << '\t'
+        << (stats.chunks ? stats.flush_ns / stats.chunks / 1e6 : 0) << '\t'
+        << stats.stall_ns / 1e6 << endl;
+    remove(file.c_str());
+  }
+  return 0;
+}
+
@@ -0,0 +1,133 @@
+// MemAddrCodecBench.cpp
+// Copyright (c) 2014 Jinglei Ren <jinglei.ren@stanzax.org>
+//
+// Rewrites the records of an existing trace with each codec, and measures
+// the trace size as well as the time to write and to parse it back.
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "mem_addr_trace.h"
+#include "mem_addr_parser.h"
+
+#define MEGA 1000000
+
+using namespace std;
+
+struct ThreadRecords {
+  uint32_t thread_id;
+  vector<MemRecord> records;
+};
+
+static uint64_t LoadTrace(const char* file,
+    vector<ThreadRecords>* threads, uint32_t* buf_len) {
+  vector<uint32_t> tids;
+  if (!MemAddrParser::ScanThreads(file, &tids)) return 0;
+  uint64_t total = 0;
+  for (vector<uint32_t>::iterator it = tids.begin(); it != tids.end(); ++it) {
+    MemAddrParser parser(file, *it);
+    *buf_len = parser.buffer_count();
+    threads->push_back(ThreadRecords());
+    threads->back().thread_id = *it;
+    MemRecord rec;
+    while (parser.Next(&rec)) {
+      threads->back().records.push_back(rec);
+    }
+    total += threads->back().records.size();
+  }
+  return total;
+}
+
+static double WriteTrace(const string& file, const BlockCodec& codec,
+    uint32_t buf_len, const vector<ThreadRecords>& threads) {
+  chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+  TraceFile trace_file(buf_len, file.c_str(), UINT32_MAX >> 12, 1, codec);
+  for (vector<ThreadRecords>::const_iterator it = threads.begin();
+      it != threads.end(); ++it) {
+    MemAddrTrace trace(&trace_file, it->thread_id);
+    for (vector<MemRecord>::const_iterator r = it->records.begin();
+        r != it->records.end(); ++r) {
+      BUG_ON(!trace.Input(r->ins_seq, (void*)r->mem_addr, r->op));
+    }
+    trace.Flush();
+  }
+  trace_file.Close();
+  chrono::duration<double> span = chrono::steady_clock::now() - begin;
+  return span.count();
+}
+
+static double ParseTrace(const string& file, uint64_t* num_records) {
+  chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+  MemAddrParser parser(file.c_str());
+  MemRecord rec;
+  *num_records = 0;
+  while (parser.Next(&rec)) ++*num_records;
+  chrono::duration<double> span = chrono::steady_clock::now() - begin;
+  return span.count();
+}
+
+int main(int argc, const char* argv[]) {
+  if (argc < 2) {
+    cerr << "Usage: " << argv[0] << " TRACE [-c CODEC[:LEVEL]]..." << endl;
+    return EINVAL;
+  }
+
+  vector<BlockCodec> codecs;
+  for (int i = 2; i < argc; ++i) {
+    BlockCodec codec;
+    if (strcmp(argv[i], "-c") == 0 && i + 1 < argc &&
+        BlockCodec::Parse(argv[++i], &codec) && codec.is_available()) {
+      codecs.push_back(codec);
+    } else {
+      cerr << "[Err] Wrong argument: " << argv[i] << endl;
+      return EINVAL;
+    }
+  }
+  if (codecs.empty()) {
+    codecs.push_back(BlockCodec(kCodecNone));
+    codecs.push_back(BlockCodec(kCodecZlib, 1));
+    codecs.push_back(BlockCodec(kCodecZlib));
+    if (BlockCodec::IsAvailable(kCodecLz4)) {
+      codecs.push_back(BlockCodec(kCodecLz4));
+    }
+    if (BlockCodec::IsAvailable(kCodecZstd)) {
+      codecs.push_back(BlockCodec(kCodecZstd));
+    }
+  }
+
+  vector<ThreadRecords> threads;
+  uint32_t buf_len = 0;
+  const uint64_t total = LoadTrace(argv[1], &threads, &buf_len);
+  if (!total) {
+    cerr << "[Error] No records in " << argv[1] << endl;
+    return EINVAL;
+  }
+
+  const string file = string(argv[1]) + ".codec";
+  cout << "# codec, level, MB, bytes/record,"
+      << " write M records/s, parse M records/s" << endl;
+  for (vector<BlockCodec>::iterator it = codecs.begin(); it != codecs.end();
+      ++it) {
+    const double write_secs = WriteTrace(file, *it, buf_len, threads);
+    FILE* f = fopen(file.c_str(), "rb");
+    BUG_ON(!f || fseek(f, 0, SEEK_END));
+    const long bytes = ftell(f);
+    fclose(f);
+    uint64_t parsed;
+    const double parse_secs = ParseTrace(file, &parsed);
+    BUG_ON(parsed != total);
+
+    cout << it->name() << '\t' << it->level() << '\t'
+        << bytes / 1e6 << '\t' << (double)bytes / total << '\t'
+        << total / write_secs / MEGA << '\t'
+        << total / parse_secs / MEGA << endl;
+    remove(file.c_str());
+  }
+  return 0;
+}
+
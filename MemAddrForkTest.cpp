@@ -0,0 +1,118 @@
+// MemAddrForkTest.cpp
+// Copyright (c) 2014 Jinglei Ren <jinglei.ren@stanzax.org>
+//
+// Forks while writer threads wait for buffers and another thread keeps
+// tracing, then tears the TraceFile down in the child as the Pintool does.
+// The child must exit instead of waiting for threads the fork left behind.
+
+#include <sys/wait.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "mem_addr_trace.h"
+
+using namespace std;
+
+static const unsigned kChildTimeout = 10; // seconds until a child is a hang
+
+static void Feed(MemAddrTrace* trace, const atomic<bool>* stop) {
+  const uint64_t base = (uint64_t)(trace->thread_id() + 1) << 32;
+  for (uint64_t i = 0; !stop->load(); ++i) {
+    trace->Input(i, (void*)(base + ((i * 8) & 0xfffff)), i % 3 ? 'R' : 'W');
+  }
+}
+
+// Returns true if the child exits cleanly.
+static bool ForkOnce(TraceFile* trace_file, MemAddrTrace* main_trace,
+    MemAddrTrace* fed_trace) {
+  main_trace->Flush();
+  trace_file->BeforeFork();
+  pid_t pid = fork();
+  if (pid == 0) {
+    alarm(kChildTimeout);
+    trace_file->AfterForkInChild();
+    delete main_trace;
+    delete fed_trace;
+    trace_file->Abandon();
+    _exit(0);
+  }
+  trace_file->AfterForkInParent();
+  if (pid < 0) {
+    cerr << "[Err] Failed to fork: " << strerror(errno) << endl;
+    return false;
+  }
+  int status;
+  if (waitpid(pid, &status, 0) != pid) return false;
+  if (WIFSIGNALED(status)) {
+    cerr << "[Err] Child " << pid << " was killed by signal "
+        << WTERMSIG(status) << (WTERMSIG(status) == SIGALRM ?
+            " (hung in teardown)" : "") << endl;
+    return false;
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, const char* argv[]) {
+  if (argc < 2) {
+    cerr << "Usage: " << argv[0] << " FILE [-r ROUNDS] [-w WRITER_THREADS]"
+        << endl;
+    return EINVAL;
+  }
+
+  const string file(argv[1]);
+  int rounds = 20;
+  int num_writers = 2;
+  for (int i = 2; i < argc; ++i) {
+    if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      rounds = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+      num_writers = atoi(argv[++i]);
+    } else {
+      cerr << "[Err] Wrong argument: " << argv[i] << endl;
+      return EINVAL;
+    }
+  }
+
+  TraceFile trace_file(4096, file.c_str(), UINT32_MAX >> 12, 2);
+  vector<thread> writers;
+  for (int i = 0; i < num_writers; ++i) {
+    writers.push_back(thread(&TraceFile::Run, &trace_file));
+  }
+  MemAddrTrace* main_trace = new MemAddrTrace(&trace_file, 0);
+  MemAddrTrace* fed_trace = new MemAddrTrace(&trace_file, 1);
+  atomic<bool> stop(false);
+  thread feeder(Feed, fed_trace, &stop);
+
+  int failures = 0;
+  for (int r = 0; r < rounds; ++r) {
+    for (uint64_t i = 0; i < 10000; ++i) {
+      main_trace->Input((uint64_t)r << 32 | i, (void*)(i * 64), 'W');
+    }
+    if (!ForkOnce(&trace_file, main_trace, fed_trace)) ++failures;
+  }
+
+  stop = true;
+  feeder.join();
+  main_trace->Flush();
+  fed_trace->Flush();
+  delete main_trace;
+  delete fed_trace;
+  trace_file.Close();
+  for (vector<thread>::iterator it = writers.begin(); it != writers.end();
+      ++it) {
+    it->join();
+  }
+  remove(file.c_str());
+
+  cout << (failures ? "[Failed] " : "[Passed] ") << rounds - failures
+      << " of " << rounds << " forked children exited" << endl;
+  return failures ? 1 : 0;
+}
@@ -1,35 +1,99 @@
 // MemAddrStats.cpp
 // Copyright (c) 2013 Jinglei Ren <jinglei.ren@stanzax.org>
 
+#include <algorithm>
 #include <cerrno>
 #include <cstdint>
 #include <cstring>
 #include <iostream>
-#include <fstream>
 #include <string>
+#include <thread>
+#include <vector>
 #include "mem_addr_parser.h"
-#include "epoch_visitor.h"
-#include "epoch_engine.h"
+#include "epoch_stats.h"
 
 #define MEGA 1000000
 
 using namespace std;
 
-static inline int NumBuckets(int page_bits) {
-  int buckets = 1 << (page_bits - CACHE_BLOCK_BITS);
-  return buckets > 16 ? 16 : buckets;
+// Feeds the writes of a slice from ins_begin to ins_end, and then those
+// before ins_limit that the next slice leaves to it.
+static void InputSlice(const char* input, uint64_t ins_begin,
+    uint64_t ins_end, uint64_t ins_limit, DirtEpochStats* stats) {
+  MemAddrParser parser(input, kWritesOnly, 0);
+  RecordBatch batch;
+  bool ending = false;
+  if (!parser.Seek(ins_begin)) return;
+  while (!stats->slice_ended() && parser.NextBatch(&batch)) {
+    const uint64_t* end = batch.ins_seqs + batch.size;
+    if (!ending && end[-1] >= ins_end) {
+      const uint32_t size = lower_bound(batch.ins_seqs, end, ins_end) -
+          batch.ins_seqs;
+      RecordBatch head = batch;
+      head.size = size;
+      stats->Input(head);
+      if (ins_end == ins_limit) break;
+      stats->EndSlice();
+      ending = true;
+      batch.ins_seqs += size;
+      batch.mem_addrs += size;
+      batch.ops += size;
+      batch.size -= size;
+      end = batch.ins_seqs + batch.size;
+    }
+    if (batch.size && end[-1] >= ins_limit) {
+      batch.size = lower_bound(batch.ins_seqs, end, ins_limit) -
+          batch.ins_seqs;
+      stats->Input(batch);
+      break;
+    }
+    stats->Input(batch);
+  }
+}
+
+// Cuts instructions first_ins to last_ins into a slice per thread, and
+// merges the other slices in order into the first, which is fed to stats.
+static void InputSlices(const char* input, uint64_t first_ins,
+    uint64_t last_ins, int num_slices, const vector<int>& epochs,
+    const vector<int>& pages, DirtEpochStats* stats) {
+  const uint64_t step = (last_ins - first_ins) / num_slices + 1;
+  vector<DirtEpochStats*> slices;
+  vector<thread> threads;
+  for (int i = 0; i < num_slices; ++i) {
+    const uint64_t begin = first_ins + step * i;
+    const uint64_t end = i + 1 < num_slices ? begin + step : last_ins + 1;
+    slices.push_back(i == 0 ? stats :
+        new DirtEpochStats(epochs, pages, kInstructions, true));
+    threads.push_back(thread(InputSlice, input, begin, end, last_ins + 1,
+        slices.back()));
+  }
+  threads[0].join();
+  for (int i = 1; i < num_slices; ++i) {
+    threads[i].join();
+    stats->Merge(*slices[i]);
+    delete slices[i];
+  }
 }
 
 int main(int argc, const char* argv[]) {
   if (argc < 6) {
     cerr << "Usage: " << argv[0]
-        << " FILE [-e EPOCH_INTERVAL]... [-p PAGE_BITS]" << endl;
+        << " FILE [-e EPOCH_INTERVAL]... [-p PAGE_BITS]..."
+        << " [-b MEGA_INS_BEGIN] [-n MEGA_INS_NUM] [-d DECODERS | -s]"
+        << " [-f [-w IDLE_SECONDS]] [-j ENGINE_THREADS] [-i]" << endl;
     return EINVAL;
   }
 
   const char* input = argv[1];
   vector<int> arg_epochs;
   vector<int> arg_pages;
+  uint64_t ins_begin = 0;
+  uint64_t ins_end = UINT64_MAX;
+  int decoders = MemAddrParser::kDefaultDecoders; // 0 to decode inline
+  bool follow = false;
+  int idle_seconds = MemAddrParser::kFollowIdleMs / 1000;
+  int workers = thread::hardware_concurrency(); // 0 to run engines inline
+  EpochUnit unit = kDirtyBlocks;
   for (int i = 2; i < argc; ++i) {
     if (strcmp(argv[i], "-e") == 0) {
       if (++i < argc) arg_epochs.push_back(atoi(argv[i]));
@@ -37,77 +101,100 @@ int main(int argc, const char* argv[]) {
     } else if (strcmp(argv[i], "-p") == 0) {
       if (++i < argc) arg_pages.push_back(atoi(argv[i]));
       else cerr << "[Err] Wrong argument!" << endl;
+    } else if (strcmp(argv[i], "-b") == 0) {
+      if (++i < argc) ins_begin = atoll(argv[i]) * MEGA;
+      else cerr << "[Err] Wrong argument!" << endl;
+    } else if (strcmp(argv[i], "-n") == 0) {
+      if (++i < argc) ins_end = atoll(argv[i]) * MEGA;
+      else cerr << "[Err] Wrong argument!" << endl;
+    } else if (strcmp(argv[i], "-d") == 0) {
+      if (++i < argc) decoders = atoi(argv[i]);
+      else cerr << "[Err] Wrong argument!" << endl;
+    } else if (strcmp(argv[i], "-j") == 0) {
+      if (++i < argc) workers = atoi(argv[i]);
+      else cerr << "[Err] Wrong argument!" << endl;
+    } else if (strcmp(argv[i], "-i") == 0) { // epochs of instructions
+      unit = kInstructions;
+    } else if (strcmp(argv[i], "-s") == 0) { // in constant memory
+      decoders = MemAddrParser::kStreaming;
+    } else if (strcmp(argv[i], "-f") == 0) { // while the trace is written
+      follow = true;
+    } else if (strcmp(argv[i], "-w") == 0) { // until the trace is given up
+      if (++i < argc) idle_seconds = atoi(argv[i]);
+      else cerr << "[Err] Wrong argument!" << endl;
     } else {
       cerr << "[Err] Wrong argument: " << argv[i] << endl;
       return EINVAL;
     }
   }
 
-  MemAddrParser parser(input);
-  vector<DirtEpochEngine> engines;
-  for (vector<int>::iterator it = arg_epochs.begin();
-      it != arg_epochs.end(); ++it) {
-    engines.push_back(*it);
-  }
-
-  vector< vector<PageDirtVisitor> > dirt_visitors;
-  for (vector<int>::iterator it = arg_pages.begin();
-      it != arg_pages.end(); ++it) {
-    dirt_visitors.push_back(vector<PageDirtVisitor>(engines.size(), *it));
-  }
-
-  // Register visitors after they are stably allocated.
-  for (vector< vector<PageDirtVisitor> >::iterator it = dirt_visitors.begin();
-      it != dirt_visitors.end(); ++it) {
-    for (unsigned int i = 0; i < engines.size(); ++i) {
-      engines[i].AddVisitor(&(*it)[i]);
-    }
-  }
- 
-  MemRecord rec;
-  while (parser.Next(&rec)) {
-    for (vector<DirtEpochEngine>::iterator it = engines.begin();
-        it != engines.end(); ++it) {
-      it->Input(rec);
-    }
-  }
-
-  for (vector<DirtEpochEngine>::iterator it = engines.begin();
-      it != engines.end(); ++it) {
-    if (it->num_epochs() == 0) it->NewEpoch();
+  // A manifest lists only closed segments, and a segment ends at its
+  // roll-over, so neither is followed to the end of tracing.
+  if (follow && (TraceManifest::IsManifest(input) ||
+      !TraceManifest::SegmentBase(input).empty())) {
+    cerr << "[Err] Cannot follow a segmented trace: " << input
+        << ". Trace with -segments 1 to follow it." << endl;
+    return EINVAL;
   }
- 
-  for (unsigned int pi = 0; pi < arg_pages.size(); ++pi) {
-    int buckets = NumBuckets(arg_pages[pi]);
-    vector<double> epoch_ratios(buckets);
-    vector<double> overall_dirts(buckets);
-    vector<double> epochs(buckets);
-    for (unsigned int ei = 0; ei < engines.size(); ++ei) {
-      dirt_visitors[pi][ei].FillEpochDirts(epoch_ratios.data(), buckets);
-      dirt_visitors[pi][ei].FillOverallDirts(overall_dirts.data(), buckets);
-      dirt_visitors[pi][ei].FillEpochSpans(epochs.data(), buckets);
+  if (ins_end != UINT64_MAX) ins_end += ins_begin;
+  DirtEpochStats stats(arg_epochs, arg_pages, unit);
+  if (follow) stats.AllowLateRecords();
+  // Epochs of instructions are counted over slices of the trace in
+  // parallel, if its index tells where the instructions are. Slices would
+  // not end for an interval of 1, at which every write is a multiple.
+  TraceExtent extent;
+  const bool sliced = unit == kInstructions && workers > 1 && !follow &&
+      !arg_epochs.empty() &&
+      *min_element(arg_epochs.begin(), arg_epochs.end()) > 1 &&
+      MemAddrParser::ScanIndex(input, &extent) &&
+      extent.first_ins < ins_end && extent.last_ins >= ins_begin;
 
-      string filename(input);
-      filename.append("-").append(to_string(engines[ei].interval()));
-      filename.append("-").append(to_string(arg_pages[pi])).append(".stats");
-      ofstream fout(filename);
-      fout << "# num_epochs=" << engines[ei].num_epochs() << endl;
-      fout << "# epoch_interval=" << fixed
-          << (double)engines[ei].overall_ins() / MEGA / engines[ei].num_epochs()
-          << "M" << endl;
-      fout << "# Epoch DR, CDF, Overall DR, Epoch Span" << endl;
-      double left_sum = 0;
-      for (int i = 0; i < buckets; ++i) {
-        fout << (double)i / buckets << '\t'
-            << left_sum << '\t'
-            << overall_dirts[i] / dirt_visitors[pi][ei].page_blocks() << '\t'
-            << epochs[i] / engines[ei].num_epochs() << endl;
-        left_sum += epoch_ratios[i];
+  // Engines only count writes. Slices are read by parsers of their own, so
+  // the filter of the trace is taken from the scan of its index.
+  uint32_t filter_line = 0;
+  uint32_t filter_entries = 0;
+  uint64_t num_late = 0;
+  bool truncated = false;
+  if (sliced) {
+    InputSlices(input, max(extent.first_ins, ins_begin),
+        min(extent.last_ins, ins_end - 1), workers, arg_epochs, arg_pages,
+        &stats);
+    filter_line = extent.filter_line;
+    filter_entries = extent.filter_entries;
+  } else {
+    MemAddrParser parser(input, kWritesOnly, decoders, follow);
+    parser.set_idle_limit_ms(idle_seconds * 1000);
+    ParallelEpochStats engines(&stats, workers);
+    // Only the chunks within the instruction window are decompressed.
+    RecordBatch batch;
+    if (ins_begin) parser.Seek(ins_begin);
+    while (parser.NextBatch(&batch)) {
+      const uint64_t* end = batch.ins_seqs + batch.size;
+      if (end[-1] >= ins_end) {
+        batch.size = lower_bound(batch.ins_seqs, end, ins_end) -
+            batch.ins_seqs;
+        engines.Input(batch);
+        break;
       }
-      fout << 1 << '\t' << left_sum << endl;
+      engines.Input(batch);
     }
+    engines.Finish();
+    filter_line = parser.filter_line();
+    filter_entries = parser.filter_entries();
+    num_late = parser.num_late();
+    truncated = parser.truncated();
   }
 
+  vector<string> notes;
+  if (unit == kInstructions) notes.push_back("epoch_unit=instructions");
+  if (ins_begin) notes.push_back("ins_begin=" + to_string(ins_begin));
+  if (filter_line) {
+    notes.push_back("line_filter=" + to_string(filter_entries) + "x" +
+        to_string(filter_line) + "B");
+  }
+  if (num_late) notes.push_back("late_records=" + to_string(num_late));
+  if (truncated) notes.push_back("truncated=1");
+  stats.Write(input, ins_begin, notes);
   return 0;
 }
 
@@ -36,30 +36,143 @@ END_LEGAL */
 
 #include <cstdio>
 #include <string>
+#include <vector>
+#include <algorithm>
 #include <atomic>
 #include "pin.H"
 #include "pinplay.H"
 #include "mem_addr_trace.h"
+#include "epoch_stats.h"
 
 #define CACHE_LINE_SIZE 64 // bytes
 #define MEGA 1000000
 
-static PIN_LOCK g_lock;
-static MemAddrTrace * g_mem_trace;
-static std::atomic_uint_fast64_t g_ins_count;
+static PIN_LOCK g_lock; // protects g_mem_traces
+static TLS_KEY g_tls_key; // per-thread ThreadState
+static REG g_state_reg; // per-thread ThreadState for analysis routines
+static TraceFile * g_trace_file;
+static std::string g_file_name; // of the trace, or prefix of the stats
+static BlockCodec g_codec;
+static std::vector<MemAddrTrace *> g_mem_traces;
+static std::vector<PIN_THREAD_UID> g_writer_uids;
+static std::atomic_uint_fast64_t g_ins_count; // synced by all threads
 static UINT64 g_ins_skip;
 static UINT64 g_ins_max;
-static volatile bool g_switch;
+static UINT64 g_sync_ins;
+
+// Each thread counts its own instructions, and adds them to g_ins_count only
+// every g_sync_ins instructions. ins_seq continues from the global count seen
+// at the last sync, so records of all threads are ordered by the global count
+// up to about g_sync_ins instructions per thread. With a single thread, it is
+// exact. The window of ins_skip and ins_max is also checked on sync only.
+struct ThreadState
+{
+    UINT64 ins_seq;
+    UINT64 pending; // instructions not yet added to g_ins_count
+    bool recording;
+    MemAddrTrace * trace;
+    char padding[CACHE_LINE_SIZE]; // keeps other threads off the cache line
+};
+
+// Instrumentation in effect. Switching modes drops the code cache, so that
+// the program is instrumented again as it goes on.
+enum TraceMode
+{
+    kFastForward, // counts instructions per basic block until ins_skip
+    kTracing, // counts instructions and records memory accesses
+    kDone // runs without instrumentation after ins_max
+};
+static std::atomic<int> g_mode;
+
+// Feeds writes to the epoch engines of MemAddrStats as buffers are handed
+// off, in place of a trace. Buffers of threads arrive one after another, so
+// ins_seq is kept from going backwards between them.
+class LiveStats : public RecordSink
+{
+  public:
+    LiveStats(const std::vector<int>& epochs,
+            const std::vector<int>& page_bits) :
+        stats_(epochs, page_bits), last_ins_(0)
+    {
+    }
+
+    void Consume(uint32_t thread_id, const uint64_t* ins,
+            void* const addrs[], const char* ops, uint32_t n)
+    {
+        MemRecord rec;
+        rec.op = 'W';
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            if (ops[i] != 'W') continue;
+            last_ins_ = std::max<uint64_t>(last_ins_, ins[i]);
+            rec.ins_seq = last_ins_;
+            rec.mem_addr = (uint64_t)addrs[i];
+            stats_.Input(rec);
+        }
+    }
+
+    DirtEpochStats& stats() { return stats_; }
+
+  private:
+    DirtEpochStats stats_;
+    uint64_t last_ins_;
+};
+static LiveStats * g_live_stats;
 
 /* Added command line option: buffer size */
 KNOB<UINT32> KnobBufferLength(KNOB_MODE_WRITEONCE, "pintool",
-    "buffer_length", "1048576", "specify the number of records to buffer");
+    "buffer_length", "1048576",
+    "specify the number of records to buffer per thread");
+
+KNOB<UINT32> KnobBuffers(KNOB_MODE_WRITEONCE, "pintool",
+    "buffers", "2", "specify the number of record buffers per thread");
+
+KNOB<UINT32> KnobWriters(KNOB_MODE_WRITEONCE, "pintool",
+    "writers", "1",
+    "specify the number of compression threads (0 to compress inline)");
+
+KNOB<string> KnobCodec(KNOB_MODE_WRITEONCE, "pintool",
+    "codec", "zlib", "specify the trace compression: none, zlib[:LEVEL], "
+    "lz4 or zstd[:LEVEL] if built in");
 
 KNOB<string> KnobFilePrefix(KNOB_MODE_WRITEONCE, "pintool",
     "file_prefix", "mem_addr", "specify prefix of output file name");
 
 KNOB<UINT32> KnobFileSize(KNOB_MODE_WRITEONCE, "pintool",
-    "file_size", "8192", "specify the max file size in MiB");
+    "file_size", "8192", "specify the max file (segment) size in MiB");
+
+KNOB<UINT32> KnobSegments(KNOB_MODE_WRITEONCE, "pintool",
+    "segments", "0",
+    "specify the max number of segment files (0 for unlimited, "
+    "1 for a single file without manifest)");
+
+KNOB<UINT32> KnobRing(KNOB_MODE_WRITEONCE, "pintool",
+    "ring", "0",
+    "specify the MiB of most recent chunks to keep in memory and write out "
+    "only on ring_signal, detach or exit (0 to write all)");
+
+KNOB<INT32> KnobRingSignal(KNOB_MODE_WRITEONCE, "pintool",
+    "ring_signal", "12", "specify the signal to dump the ring (SIGUSR2)");
+
+KNOB<UINT32> KnobLineFilter(KNOB_MODE_WRITEONCE, "pintool",
+    "line_filter", "0",
+    "specify the number of recent cache lines per thread whose repeated "
+    "reads or writes within sync_ins instructions are not recorded "
+    "(0 to record all)");
+
+KNOB<UINT32> KnobLiveEpochs(KNOB_MODE_APPEND, "pintool",
+    "live_epoch", "",
+    "analyze page dirtiness live over epochs of this many dirty blocks, "
+    "like MemAddrStats -e, instead of writing a trace");
+
+KNOB<UINT32> KnobLivePageBits(KNOB_MODE_APPEND, "pintool",
+    "live_page_bits", "", "specify the page bits of the live analysis, "
+    "like MemAddrStats -p");
+
+KNOB<UINT32> KnobLiveBatch(KNOB_MODE_WRITEONCE, "pintool",
+    "live_batch", "4096",
+    "specify the number of records per thread handed off at once "
+    "to the live analysis");
 
 KNOB<UINT64> KnobInsSkip(KNOB_MODE_WRITEONCE, "pintool",
     "ins_skip", "0", "specify the number of mega-instructions to skip");
@@ -67,6 +180,10 @@ KNOB<UINT64> KnobInsSkip(KNOB_MODE_WRITEONCE, "pintool",
 KNOB<UINT64> KnobInsMax(KNOB_MODE_WRITEONCE, "pintool",
     "ins_max", "1000000", "specify the max number of mega-instructions");
 
+KNOB<UINT64> KnobSyncIns(KNOB_MODE_WRITEONCE, "pintool",
+    "sync_ins", "4096",
+    "specify the number of instructions between syncs of thread counters");
+
 PINPLAY_ENGINE pinplay_engine;
 KNOB<BOOL> KnobPinPlayLogger(KNOB_MODE_WRITEONCE, "pintool",
     "log", "0", "Activate the pinplay logger");
@@ -74,58 +191,134 @@ KNOB<BOOL> KnobPinPlayLogger(KNOB_MODE_WRITEONCE, "pintool",
 KNOB<BOOL> KnobPinPlayReplayer(KNOB_MODE_WRITEONCE, "pintool",
     "replay", "0", "Activate the pinplay replayer");
 
+VOID WriterThread(VOID * arg)
+{
+    static_cast<TraceFile *>(arg)->Run();
+}
+
 VOID InitGlobal()
 {
     PIN_InitLock(&g_lock);
 
-    std::string file_name(KnobFilePrefix.Value());
-    file_name.append("_").append(std::to_string(PIN_GetPid())).append(".trace");
-    g_mem_trace = new MemAddrTrace(KnobBufferLength.Value(),
-        file_name.c_str(), KnobFileSize.Value());
+    g_file_name = KnobFilePrefix.Value();
+    g_file_name.append("_").append(std::to_string(PIN_GetPid()));
+    if (KnobLiveEpochs.NumberOfValues())
+    {
+        std::vector<int> epochs, page_bits;
+        for (UINT32 i = 0; i < KnobLiveEpochs.NumberOfValues(); ++i) {
+            epochs.push_back(KnobLiveEpochs.Value(i));
+        }
+        for (UINT32 i = 0; i < KnobLivePageBits.NumberOfValues(); ++i) {
+            page_bits.push_back(KnobLivePageBits.Value(i));
+        }
+        g_live_stats = new LiveStats(epochs, page_bits);
+        g_trace_file = new TraceFile(KnobLiveBatch.Value(), g_live_stats,
+            KnobBuffers.Value());
+    }
+    else
+    {
+        if (KnobSegments.Value() == 1 || KnobRing.Value()) {
+            g_file_name.append(".trace");
+        }
+        g_trace_file = new TraceFile(KnobBufferLength.Value(),
+            g_file_name.c_str(), KnobFileSize.Value(), KnobBuffers.Value(),
+            g_codec, KnobSegments.Value(), KnobRing.Value(),
+            LineFilter(CACHE_LINE_SIZE, KnobLineFilter.Value()));
+    }
+
+    for (UINT32 i = 0; i < KnobWriters.Value(); ++i) {
+        PIN_THREAD_UID uid;
+        if (PIN_SpawnInternalThread(WriterThread, g_trace_file, 0, &uid) ==
+                INVALID_THREADID) {
+            std::cerr << "[Warn] Failed to spawn writer thread." << std::endl;
+            break;
+        }
+        g_writer_uids.push_back(uid);
+    }
 
     g_ins_count = 0;
     g_ins_skip = KnobInsSkip.Value() * MEGA;
     g_ins_max = KnobInsMax.Value() * MEGA + (MEGA / 10);
-    g_switch = false;
+    g_sync_ins = std::max<UINT64>(KnobSyncIns.Value(), 1);
+    g_mode = g_ins_skip ? kFastForward : kTracing;
 }
 
-VOID InsCount(THREADID tid)
+// Returns true on the first change from the given mode.
+static bool SwitchMode(int from, int to)
 {
-    UINT64 ins_count = ++g_ins_count; // starts from 1
-    g_switch = (g_ins_skip < ins_count) && (ins_count < g_ins_max);
+    if (!g_mode.compare_exchange_strong(from, to)) return false;
+    PIN_RemoveInstrumentation();
+    return true;
 }
 
-VOID RecordMemRead(THREADID tid, VOID * addr)
+// Is called once per basic block while fast-forwarding.
+ADDRINT PIN_FAST_ANALYSIS_CALL FastForward(ThreadState * state,
+        UINT32 num_ins)
 {
-    if (!g_switch) return;
-    PIN_GetLock(&g_lock, tid);
-    if (!g_mem_trace->Input(g_ins_count, addr, 'R')) {
+    state->ins_seq += num_ins;
+    return (state->pending += num_ins) >= g_sync_ins;
+}
+
+// Is called for every instruction while tracing.
+ADDRINT PIN_FAST_ANALYSIS_CALL InsCount(ThreadState * state)
+{
+    ++state->ins_seq; // starts from 1
+    return ++state->pending >= g_sync_ins;
+}
+
+// Adds pending instructions of the thread to the global count, and
+// switches modes once the count leaves the skipped region or the window.
+// A switch takes effect as threads enter newly instrumented code.
+VOID SyncInsCount(ThreadState * state)
+{
+    UINT64 ins_count = (g_ins_count += state->pending);
+    state->pending = 0;
+    state->ins_seq = ins_count;
+    // Repeats are dropped only within g_sync_ins instructions of a thread,
+    // so that epochs later on still see the lines written again.
+    state->trace->ResetFilter();
+    state->recording = (g_ins_skip <= ins_count) && (ins_count < g_ins_max);
+    if (ins_count >= g_ins_max) {
+        if (!SwitchMode(kTracing, kDone)) SwitchMode(kFastForward, kDone);
+    } else if (ins_count >= g_ins_skip) {
+        SwitchMode(kFastForward, kTracing);
+    }
+}
+
+// Each thread fills its own buffer, so no lock is needed here.
+VOID RecordMemRead(ThreadState * state, VOID * addr)
+{
+    if (!state->recording) return;
+    if (!state->trace->Input(state->ins_seq, addr, 'R')) {
         PIN_Detach();
     }
 #ifdef TEST
-    std::cout << g_ins_count << '\t' << addr << "\tR" << std::endl;
+    std::cout << state->ins_seq << '\t' << addr << "\tR" << std::endl;
 #endif
-    PIN_ReleaseLock(&g_lock);
 }
 
-VOID RecordMemWrite(THREADID tid, VOID * addr)
+VOID RecordMemWrite(ThreadState * state, VOID * addr)
 {
-    if (!g_switch) return;
-    PIN_GetLock(&g_lock, tid);
-    if (!g_mem_trace->Input(g_ins_count, addr, 'W')) {
+    if (!state->recording) return;
+    if (!state->trace->Input(state->ins_seq, addr, 'W')) {
         PIN_Detach();
     }
 #ifdef TEST
-    std::cout << g_ins_count << '\t' << addr << "\tW" << std::endl;
+    std::cout << state->ins_seq << '\t' << addr << "\tW" << std::endl;
 #endif
-    PIN_ReleaseLock(&g_lock);
 }
 
-// Is called for every instruction and instruments reads and writes
-VOID Instruction(INS ins, VOID *v)
+// Instruments reads and writes of an instruction when tracing
+VOID Instruction(INS ins)
 {
-    INS_InsertCall(
-        ins, IPOINT_BEFORE, (AFUNPTR)InsCount, IARG_THREAD_ID,
+    INS_InsertIfCall(
+        ins, IPOINT_BEFORE, (AFUNPTR)InsCount, IARG_FAST_ANALYSIS_CALL,
+        IARG_REG_VALUE, g_state_reg,
+        IARG_CALL_ORDER, CALL_ORDER_FIRST,
+        IARG_END);
+    INS_InsertThenCall(
+        ins, IPOINT_BEFORE, (AFUNPTR)SyncInsCount,
+        IARG_REG_VALUE, g_state_reg,
         IARG_CALL_ORDER, CALL_ORDER_FIRST,
         IARG_END);
 
@@ -139,11 +332,11 @@ VOID Instruction(INS ins, VOID *v)
     // Iterate over each memory operand of the instruction.
     for (UINT32 memOp = 0; memOp < memOperands; memOp++)
     {
-        if (INS_MemoryOperandIsRead(ins, memOp))
+        if (INS_MemoryOperandIsRead(ins, memOp) && !g_live_stats)
         {
             INS_InsertPredicatedCall(
                 ins, IPOINT_BEFORE, (AFUNPTR)RecordMemRead,
-                IARG_THREAD_ID,
+                IARG_REG_VALUE, g_state_reg,
                 IARG_MEMORYOP_EA, memOp,
                 IARG_END);
         }
@@ -154,19 +347,135 @@ VOID Instruction(INS ins, VOID *v)
         {
             INS_InsertPredicatedCall(
                 ins, IPOINT_BEFORE, (AFUNPTR)RecordMemWrite,
-                IARG_THREAD_ID,
+                IARG_REG_VALUE, g_state_reg,
                 IARG_MEMORYOP_EA, memOp,
                 IARG_END);
         }
     }
 }
 
+// Is called for every trace, and instruments it according to the mode
+VOID Trace(TRACE trace, VOID *v)
+{
+    const int mode = g_mode;
+    if (mode == kDone) return;
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
+    {
+        if (mode == kFastForward)
+        {
+            BBL_InsertIfCall(
+                bbl, IPOINT_BEFORE, (AFUNPTR)FastForward,
+                IARG_FAST_ANALYSIS_CALL,
+                IARG_REG_VALUE, g_state_reg,
+                IARG_UINT32, BBL_NumIns(bbl),
+                IARG_END);
+            BBL_InsertThenCall(
+                bbl, IPOINT_BEFORE, (AFUNPTR)SyncInsCount,
+                IARG_REG_VALUE, g_state_reg,
+                IARG_END);
+            continue;
+        }
+        for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+        {
+            Instruction(ins);
+        }
+    }
+}
+
+static inline ThreadState * GetThreadState(THREADID tid)
+{
+    return static_cast<ThreadState *>(PIN_GetThreadData(g_tls_key, tid));
+}
+
+// Gives the thread a new buffer, and counts on from the global count.
+VOID InitThreadState(THREADID tid, ThreadState * state)
+{
+    state->trace = new MemAddrTrace(g_trace_file, tid);
+    state->pending = 0;
+    SyncInsCount(state);
+    PIN_GetLock(&g_lock, tid);
+    g_mem_traces.push_back(state->trace);
+    PIN_ReleaseLock(&g_lock);
+}
+
+VOID ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+    ThreadState * state = new ThreadState();
+    InitThreadState(tid, state);
+    PIN_SetThreadData(g_tls_key, state, tid);
+    PIN_SetContextReg(ctxt, g_state_reg, reinterpret_cast<ADDRINT>(state));
+}
+
+VOID ThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v)
+{
+    ThreadState * state = GetThreadState(tid);
+    MemAddrTrace * trace = state->trace;
+    PIN_GetLock(&g_lock, tid);
+    // The buffer may already be released by Detach.
+    std::vector<MemAddrTrace *>::iterator it =
+        std::find(g_mem_traces.begin(), g_mem_traces.end(), trace);
+    if (it != g_mem_traces.end()) {
+        trace->Flush();
+        g_mem_traces.erase(it);
+        delete trace;
+    }
+    PIN_ReleaseLock(&g_lock);
+    PIN_SetThreadData(g_tls_key, 0, tid);
+    delete state;
+}
+
+// Releases all thread buffers, flushing them first if required
+VOID ReleaseAll(THREADID tid, bool flush)
+{
+    PIN_GetLock(&g_lock, tid);
+    for (std::vector<MemAddrTrace *>::iterator it = g_mem_traces.begin();
+            it != g_mem_traces.end(); ++it) {
+        if (flush) (*it)->Flush();
+        delete *it;
+    }
+    g_mem_traces.clear();
+    PIN_ReleaseLock(&g_lock);
+}
+
 VOID Detach(VOID *v)
 {
-    PIN_GetLock(&g_lock, 0);
-    g_mem_trace->Flush();
-    PIN_ReleaseLock(&g_lock); 
-    delete g_mem_trace;
+    if (!g_trace_file) return;
+    ReleaseAll(0, true);
+    g_trace_file->Close();
+
+    TraceStats stats = g_trace_file->stats();
+    std::cerr << "[Info] MemAddrTrace flushed " << stats.chunks << " chunks"
+        << ", avg latency " << (stats.chunks ?
+            stats.flush_ns / stats.chunks / 1e6 : 0) << " ms"
+        << ", max latency " << stats.max_flush_ns / 1e6 << " ms"
+        << ", stalled " << stats.stalls << " times"
+        << " for " << stats.stall_ns / 1e6 << " ms" << std::endl;
+    if (g_trace_file->is_ring()) {
+        std::cerr << "[Info] MemAddrTrace dropped " << stats.dropped_chunks
+            << " chunks out of the ring" << std::endl;
+    }
+    // Epochs count from instruction 0, as MemAddrStats does on the trace
+    // of the same run, so the .stats files compare.
+    if (g_live_stats) {
+        g_live_stats->stats().Write(g_file_name, 0,
+            std::vector<std::string>());
+        delete g_live_stats;
+        g_live_stats = 0;
+    }
+
+    delete g_trace_file;
+    g_trace_file = 0;
+}
+
+// Writer threads have to exit before Pin calls Fini.
+VOID PrepareForFini(VOID *v)
+{
+    g_trace_file->Stop();
+    for (std::vector<PIN_THREAD_UID>::iterator it = g_writer_uids.begin();
+            it != g_writer_uids.end(); ++it) {
+        PIN_WaitForThreadTermination(*it, PIN_INFINITE_TIMEOUT, 0);
+    }
+    g_writer_uids.clear();
 }
 
 VOID Fini(INT32 code, VOID *v)
@@ -174,17 +483,52 @@ VOID Fini(INT32 code, VOID *v)
     Detach(v);
 }
 
+// Dumps the ring to <prefix>_<pid>.<n>.trace, and keeps the signal from
+// the application.
+BOOL DumpRing(THREADID tid, INT32 sig, CONTEXT *ctxt, BOOL has_handler,
+        const EXCEPTION_INFO *info, VOID *v)
+{
+    static UINT32 num_dumps = 0;
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%04u.trace", num_dumps++);
+    std::string file_name(KnobFilePrefix.Value());
+    file_name.append("_").append(std::to_string(PIN_GetPid())).append(suffix);
+    if (g_trace_file && g_trace_file->Dump(file_name)) {
+        std::cerr << "[Info] MemAddrTrace dumped the ring to " << file_name
+            << std::endl;
+    }
+    return FALSE;
+}
+
+// Holds g_lock and keeps buffers from being handed off until after the
+// fork. Other threads keep filling their own buffers, which are not flushed
+// here as they are in use.
 VOID BeforeFork(THREADID tid, const CONTEXT* ctxt, VOID * arg)
 {
     PIN_GetLock(&g_lock, tid);
-    g_mem_trace->Flush();
+    GetThreadState(tid)->trace->Flush();
+    g_trace_file->BeforeFork();
+}
+
+VOID AfterForkInParent(THREADID tid, const CONTEXT* ctxt, VOID * arg)
+{
+    g_trace_file->AfterForkInParent();
     PIN_ReleaseLock(&g_lock);
 }
 
+// Only the forking thread survives in the child.
 VOID AfterForkInChild(THREADID threadid, const CONTEXT* ctxt, VOID * arg)
 {
-    delete g_mem_trace;
+    g_trace_file->AfterForkInChild();
+    PIN_ReleaseLock(&g_lock);
+    ReleaseAll(threadid, false);
+    g_trace_file->Abandon(); // leaked, see TraceFile::Abandon()
+    delete g_live_stats;
+    g_live_stats = 0;
+    g_writer_uids.clear();
     InitGlobal();
+    PIN_RemoveInstrumentation(); // the child counts from 0 again
+    InitThreadState(threadid, GetThreadState(threadid));
 }
 
 /* ===================================================================== */
@@ -206,12 +550,33 @@ int main(int argc, char *argv[])
 {
     if (PIN_Init(argc, argv)) return Usage();
     pinplay_engine.Activate(argc, argv, KnobPinPlayLogger, KnobPinPlayReplayer);
+    if (!BlockCodec::Parse(KnobCodec.Value().c_str(), &g_codec) ||
+            !g_codec.is_available()) {
+        std::cerr << "[Error] Unsupported codec: " << KnobCodec.Value()
+            << std::endl;
+        return Usage();
+    }
 
+    g_tls_key = PIN_CreateThreadDataKey(0);
+    g_state_reg = PIN_ClaimToolRegister();
+    if (g_state_reg == REG_INVALID()) {
+        std::cerr << "[Error] No tool register available." << std::endl;
+        return 1;
+    }
     InitGlobal();
 
+    if (g_trace_file->is_ring() && KnobRingSignal.Value()) {
+        PIN_InterceptSignal(KnobRingSignal.Value(), DumpRing, 0);
+        PIN_UnblockSignal(KnobRingSignal.Value(), TRUE);
+    }
+
+    PIN_AddThreadStartFunction(ThreadStart, 0);
+    PIN_AddThreadFiniFunction(ThreadFini, 0);
     PIN_AddForkFunction(FPOINT_BEFORE, BeforeFork, 0);
+    PIN_AddForkFunction(FPOINT_AFTER_IN_PARENT, AfterForkInParent, 0);
     PIN_AddForkFunction(FPOINT_AFTER_IN_CHILD, AfterForkInChild, 0);
-    INS_AddInstrumentFunction(Instruction, 0);
+    TRACE_AddInstrumentFunction(Trace, 0);
+    PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
     PIN_AddFiniFunction(Fini, 0);
     PIN_AddDetachFunction(Detach, 0);
 
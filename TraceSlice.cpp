@@ -0,0 +1,139 @@
+// TraceSlice.cpp
+// Copyright (c) 2014 Jinglei Ren <jinglei.ren@stanzax.org>
+//
+// Writes the records of a trace that fall in an instruction window and an
+// address range, optionally only writes, as a new trace. Chunks that the
+// index shows to hold none of them are not decompressed, and records are
+// written out as they are read, so the input is never held in memory.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include "mem_addr_trace.h"
+#include "mem_addr_parser.h"
+
+#define MEGA 1000000
+
+using namespace std;
+
+// Parses BEGIN:END in hex or decimal, as a half-open range.
+static bool ParseRange(const char* arg, uint64_t* begin, uint64_t* end) {
+  char* p;
+  *begin = strtoull(arg, &p, 0);
+  if (*p != ':') return false;
+  *end = strtoull(p + 1, &p, 0);
+  return *p == '\0' && *begin < *end;
+}
+
+// Parses PAGE_BITS:PAGE into the address range of that page.
+static bool ParsePage(const char* arg, uint64_t* begin, uint64_t* end) {
+  char* p;
+  const unsigned long bits = strtoul(arg, &p, 0);
+  if (*p != ':' || bits >= 64) return false;
+  const uint64_t page = strtoull(p + 1, &p, 0);
+  if (*p != '\0' || page >= (UINT64_MAX >> bits)) return false;
+  *begin = page << bits;
+  *end = (page + 1) << bits;
+  return true;
+}
+
+int main(int argc, const char* argv[]) {
+  if (argc < 3) {
+    cerr << "Usage: " << argv[0] << " FILE OUTPUT"
+        << " [-b MEGA_INS_BEGIN] [-n MEGA_INS_NUM] [-w]"
+        << " [-a ADDR_BEGIN:ADDR_END | -g PAGE_BITS:PAGE]"
+        << " [-c CODEC[:LEVEL]] [-d DECODERS]" << endl;
+    return EINVAL;
+  }
+
+  const char* input = argv[1];
+  const char* output = argv[2];
+  RecordRange range;
+  uint64_t ins_num = 0;
+  bool writes_only = false;
+  BlockCodec codec;
+  int decoders = MemAddrParser::kDefaultDecoders;
+  for (int i = 3; i < argc; ++i) {
+    const bool has_value = i + 1 < argc;
+    bool ok = true;
+    if (strcmp(argv[i], "-b") == 0 && has_value) {
+      range.ins_begin = atoll(argv[++i]) * MEGA;
+    } else if (strcmp(argv[i], "-n") == 0 && has_value) {
+      ins_num = atoll(argv[++i]) * MEGA;
+    } else if (strcmp(argv[i], "-w") == 0) {
+      writes_only = true;
+    } else if (strcmp(argv[i], "-a") == 0 && has_value) {
+      ok = ParseRange(argv[++i], &range.addr_begin, &range.addr_end);
+    } else if (strcmp(argv[i], "-g") == 0 && has_value) {
+      ok = ParsePage(argv[++i], &range.addr_begin, &range.addr_end);
+    } else if (strcmp(argv[i], "-c") == 0 && has_value) {
+      ok = BlockCodec::Parse(argv[++i], &codec) && codec.is_available();
+    } else if (strcmp(argv[i], "-d") == 0 && has_value) {
+      decoders = atoi(argv[++i]);
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      cerr << "[Err] Wrong argument: " << argv[i] << endl;
+      return EINVAL;
+    }
+  }
+  if (ins_num) range.ins_end = range.ins_begin + ins_num;
+
+  MemAddrParser parser(input, writes_only ? kWritesOnly : kAllRecords,
+      decoders);
+  if (parser.thread_ids().empty()) {
+    cerr << "[Error] Failed to open " << input << endl;
+    return ENFILE;
+  }
+
+  // Records of a filtered input are not filtered again, but noted so.
+  TraceFile trace_file(parser.buffer_count(), output, UINT32_MAX >> 12, 2,
+      codec, 1, 0, LineFilter(),
+      LineFilter(parser.filter_line(), parser.filter_entries()));
+  thread writer(&TraceFile::Run, &trace_file);
+  map<uint32_t, MemAddrTrace*> traces; // of each thread in the input
+
+  uint64_t num_records = 0;
+  bool ok = true;
+  RecordBatch batch;
+  bool more = parser.Restrict(range);
+  while (more && ok && parser.NextBatch(&batch)) {
+    const uint64_t* end = batch.ins_seqs + batch.size;
+    if (end[-1] >= range.ins_end) {
+      batch.size = lower_bound(batch.ins_seqs, end, range.ins_end) -
+          batch.ins_seqs;
+      more = false;
+    }
+    MemAddrTrace*& trace = traces[batch.thread_id];
+    for (uint32_t i = 0; i < batch.size && ok; ++i) {
+      if (!range.Contains(batch.ins_seqs[i], batch.mem_addrs[i])) continue;
+      if (!trace) trace = new MemAddrTrace(&trace_file, batch.thread_id);
+      ok = trace->Input(batch.ins_seqs[i], (void*)batch.mem_addrs[i],
+          batch.ops[i]);
+      ++num_records;
+    }
+  }
+
+  for (map<uint32_t, MemAddrTrace*>::iterator it = traces.begin();
+      it != traces.end(); ++it) {
+    if (!it->second) continue;
+    ok = it->second->Flush() && ok;
+    delete it->second;
+  }
+  trace_file.Close();
+  writer.join();
+  if (!ok) {
+    cerr << "[Error] Failed to write " << output << endl;
+    return EIO;
+  }
+  cerr << "Sliced " << num_records << " records into " << output << endl;
+  return 0;
+}
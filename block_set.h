@@ -0,0 +1,121 @@
+// block_set.h
+// Copyright (c) 2014 Jinglei Ren <jinglei.ren@stanzax.org>
+
+#ifndef SEXAIN_BLOCK_SET_H_
+#define SEXAIN_BLOCK_SET_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Set of block numbers in a flat table with linear probing, as a drop-in
+// for std::unordered_set<uint64_t> in epoch engines and visitors.
+//
+// Blocks are also kept in a dense array in the order they are inserted,
+// which is what iteration runs over. Each slot of the table is tagged with
+// the generation it was filled in, and a slot of an earlier generation is
+// empty, so clear() takes constant time regardless of the capacity.
+class BlockSet {
+ public:
+  typedef std::vector<uint64_t>::const_iterator const_iterator;
+
+  BlockSet();
+
+  // Returns whether the block is new to the set.
+  bool insert(uint64_t block);
+  size_t count(uint64_t block) const;
+  void clear();
+  void swap(BlockSet& other);
+
+  size_t size() const { return blocks_.size(); }
+  bool empty() const { return blocks_.empty(); }
+  const_iterator begin() const { return blocks_.begin(); }
+  const_iterator end() const { return blocks_.end(); }
+
+  static const int kMinBits = 10;
+
+ private:
+  struct Slot {
+    uint64_t block;
+    uint32_t generation;
+  };
+
+  size_t Hash(uint64_t block) const {
+    return (block * 0x9E3779B97F4A7C15ull) >> (64 - bits_);
+  }
+  void Grow();
+
+  std::vector<Slot> slots_;
+  std::vector<uint64_t> blocks_;
+  int bits_; // of the number of slots
+  size_t mask_;
+  uint32_t generation_; // of the slots in use
+};
+
+// Implementations
+
+inline BlockSet::BlockSet() : bits_(kMinBits), generation_(1) {
+  Slot empty = { 0, 0 };
+  slots_.assign((size_t)1 << bits_, empty);
+  mask_ = slots_.size() - 1;
+}
+
+inline bool BlockSet::insert(uint64_t block) {
+  for (size_t i = Hash(block); ; i = (i + 1) & mask_) {
+    Slot& slot = slots_[i];
+    if (slot.generation != generation_) {
+      slot.block = block;
+      slot.generation = generation_;
+      blocks_.push_back(block);
+      // Keeps the load factor no more than a half.
+      if (blocks_.size() * 2 > slots_.size()) Grow();
+      return true;
+    }
+    if (slot.block == block) return false;
+  }
+}
+
+inline size_t BlockSet::count(uint64_t block) const {
+  for (size_t i = Hash(block); ; i = (i + 1) & mask_) {
+    const Slot& slot = slots_[i];
+    if (slot.generation != generation_) return 0;
+    if (slot.block == block) return 1;
+  }
+}
+
+inline void BlockSet::clear() {
+  blocks_.clear();
+  if (++generation_ == 0) { // wraps around after 2^32 epochs
+    for (std::vector<Slot>::iterator it = slots_.begin(); it != slots_.end();
+        ++it) {
+      it->generation = 0;
+    }
+    generation_ = 1;
+  }
+}
+
+inline void BlockSet::swap(BlockSet& other) {
+  slots_.swap(other.slots_);
+  blocks_.swap(other.blocks_);
+  std::swap(bits_, other.bits_);
+  std::swap(mask_, other.mask_);
+  std::swap(generation_, other.generation_);
+}
+
+// Doubles the table and reinserts the blocks from the dense array.
+inline void BlockSet::Grow() {
+  ++bits_;
+  Slot empty = { 0, 0 };
+  slots_.assign((size_t)1 << bits_, empty);
+  mask_ = slots_.size() - 1;
+  generation_ = 1;
+  for (const_iterator it = blocks_.begin(); it != blocks_.end(); ++it) {
+    size_t i = Hash(*it);
+    while (slots_[i].generation == generation_) i = (i + 1) & mask_;
+    slots_[i].block = *it;
+    slots_[i].generation = generation_;
+  }
+}
+
+#endif // SEXAIN_BLOCK_SET_H_
@@ -5,6 +5,12 @@
 
 // EpochEngine
 
+void EpochEngine::MergeCounts(const EpochEngine& other) {
+  num_epochs_ += other.num_epochs_;
+  overall_dirts_ += other.overall_dirts_;
+  if (other.overall_ins_ > overall_ins_) overall_ins_ = other.overall_ins_;
+}
+
 void EpochEngine::NewEpoch() {
   for (std::vector<EpochVisitor*>::iterator it = visitors_.begin();
       it != visitors_.end(); ++it) {
@@ -15,17 +21,64 @@ void EpochEngine::NewEpoch() {
   blocks_.clear();
 }
 
+void EpochEngine::Input(const RecordBatch& batch) {
+  MemRecord rec;
+  for (uint32_t i = 0; i < batch.size; ++i) {
+    rec.ins_seq = batch.ins_seqs[i];
+    rec.mem_addr = batch.mem_addrs[i];
+    rec.op = batch.ops[i];
+    Input(rec);
+  }
+}
+
 // InsEpochEngine
 
 bool InsEpochEngine::Input(const MemRecord& rec) {
-  if (!EpochEngine::Input(rec)) return false;
-  if (overall_ins() > epoch_max_) {
+  if (rec.op != 'W') return false;
+  Write(rec.ins_seq, rec.mem_addr);
+  return true;
+}
+
+void InsEpochEngine::Input(const RecordBatch& batch) {
+  for (uint32_t i = 0; i < batch.size; ++i) {
+    if (batch.ops[i] != 'W') continue;
+    Write(batch.ins_seqs[i], batch.mem_addrs[i]);
+  }
+}
+
+// Keeps the first epoch of a slice aside instead of visiting it.
+void InsEpochEngine::EndEpoch() {
+  if (!sliced_ || has_first_) {
+    NewEpoch();
+    return;
+  }
+  has_first_ = true;
+  first_max_ = epoch_max_;
+  first_blocks_.clear();
+  mutable_blocks()->swap(first_blocks_);
+}
+
+// Adds blocks to the epoch that ends at epoch_max, which is the current one
+// or else follows it.
+void InsEpochEngine::Continue(uint64_t epoch_max, const BlockSet& blocks) {
+  if (epoch_max != epoch_max_) {
     if (epoch_max_) {
-      NewEpoch();
+      EndEpoch();
     }
-    epoch_max_ = (rec.ins_seq / interval() + 1) * interval();
+    epoch_max_ = epoch_max;
   }
-  DirtyBlock(rec.mem_addr);
-  return true;
+  DirtyBlocks(blocks);
 }
 
+void InsEpochEngine::Merge(const InsEpochEngine& slice) {
+  assert(!sliced_ && slice.sliced_ && interval() == slice.interval());
+  if (slice.has_first_) {
+    Continue(slice.first_max_, slice.first_blocks_);
+    NewEpoch(); // as the slice has gone beyond it
+    epoch_max_ = slice.epoch_max_;
+  }
+  MergeCounts(slice); // of the epochs visited by the slice
+  if (slice.epoch_max_) Continue(slice.epoch_max_, slice.blocks());
+  ending_ = slice.ending_;
+  ended_ = slice.ended_;
+}
@@ -12,20 +12,34 @@
 class EpochEngine {
  public:
   EpochEngine(int interval);
+  virtual ~EpochEngine() { }
   void AddVisitor(EpochVisitor* v) { visitors_.push_back(v); }
-  virtual bool Input(const MemRecord& rec); // assumes increasing ins_seq
+  virtual bool Input(const MemRecord& rec); // in order of ins_seq
+  virtual void Input(const RecordBatch& batch);
   int num_epochs() const { return num_epochs_; }
   int interval() const { return interval_; }
   uint64_t overall_ins() const { return overall_ins_; }
   uint64_t overall_dirts() const { return overall_dirts_; }
+  // Dirty blocks of the current epoch
+  const BlockSet& blocks() const { return blocks_; }
   void NewEpoch();
+  // Takes late records of a followed trace (see MemAddrParser), which are
+  // counted in the epoch at hand. Other input must be in order.
+  void AllowLateRecords() { late_records_ = true; }
  protected:
   void DirtyBlock(uint64_t mem_addr);
+  void DirtyBlocks(const BlockSet& blocks);
+  void set_overall_ins(uint64_t ins_seq);
   int NumBlocks() { return blocks_.size(); }
+  // Adds the counts of another engine, whose epochs have been visited by
+  // visitors of its own.
+  void MergeCounts(const EpochEngine& other);
+  BlockSet* mutable_blocks() { return &blocks_; }
  private:
   std::vector<EpochVisitor*> visitors_;
   BlockSet blocks_;
   int interval_;
+  bool late_records_;
   int num_epochs_;
   uint64_t overall_ins_;
   uint64_t overall_dirts_;
@@ -35,21 +49,55 @@ class DirtEpochEngine : public EpochEngine {
  public:
   DirtEpochEngine(int epoch_dirts) : EpochEngine(epoch_dirts) { }
   bool Input(const MemRecord& rec);
+  void Input(const RecordBatch& batch);
 };
 
+// Epochs end at multiples of the interval. A write at ins_seq x belongs
+// to the epoch that ends at the next multiple, except that a write at a
+// multiple belongs to the current epoch if that epoch ends there.
+// Writes at 0 belong to the epoch of the next write.
+//
+// Only writes at multiples depend on the epoch before them, so a trace can
+// be cut into slices of instructions and each slice run by an engine of its
+// own. An engine of a slice that follows another leaves out the writes at
+// multiples before its first other write, and keeps its first epoch aside
+// instead of visiting it. After EndSlice(), an engine takes only the writes
+// at multiples up to the first other write, as they may continue its last
+// epoch. Merge() continues an engine with the next slice, which ends up as
+// if it had been run over both.
 class InsEpochEngine : public EpochEngine {
  public:
-  InsEpochEngine(int num_ins) : EpochEngine(num_ins), epoch_max_(0) { }
+  InsEpochEngine(int num_ins, bool sliced = false);
   bool Input(const MemRecord& rec);
+  void Input(const RecordBatch& batch);
+  void EndSlice() { ending_ = true; }
+  // Whether the engine takes no more writes after EndSlice()
+  bool ended() const { return ended_; }
+  // Continues with the slice that follows the writes input so far.
+  // Visitors of the slice are left to be merged by the caller.
+  void Merge(const InsEpochEngine& slice);
  private:
+  void Write(uint64_t ins_seq, uint64_t mem_addr);
+  void EndEpoch();
+  void Continue(uint64_t epoch_max, const BlockSet& blocks);
+
+  const bool sliced_;
+  bool skipping_; // writes at multiples left to the previous slice
+  bool ending_;
+  bool ended_;
   uint64_t epoch_max_;
+  // The first epoch of a slice, once it has ended
+  bool has_first_;
+  uint64_t first_max_;
+  BlockSet first_blocks_;
 };
 
 // Implementations
 
 // EpochEngine
 
-inline EpochEngine::EpochEngine(int interval) : interval_(interval) {
+inline EpochEngine::EpochEngine(int interval) :
+    interval_(interval), late_records_(false) {
   num_epochs_ = 0;
   overall_ins_ = 0;
   overall_dirts_ = 0;
@@ -57,8 +105,7 @@ inline EpochEngine::EpochEngine(int interval) : interval_(interval) {
 
 inline bool EpochEngine::Input(const MemRecord& rec) {
   if (rec.op != 'W') return false;
-  assert(rec.ins_seq >= overall_ins_);
-  overall_ins_ = rec.ins_seq;
+  set_overall_ins(rec.ins_seq);
   return true;
 }
 
@@ -66,6 +113,21 @@ inline void EpochEngine::DirtyBlock(uint64_t mem_addr) {
   blocks_.insert(mem_addr >> CACHE_BLOCK_BITS);
 }
 
+inline void EpochEngine::DirtyBlocks(const BlockSet& blocks) {
+  for (BlockSet::const_iterator it = blocks.begin(); it != blocks.end();
+      ++it) {
+    blocks_.insert(*it);
+  }
+}
+
+inline void EpochEngine::set_overall_ins(uint64_t ins_seq) {
+  if (ins_seq < overall_ins_) {
+    assert(late_records_);
+    return;
+  }
+  overall_ins_ = ins_seq;
+}
+
 // DirtEpochEngine
 
 inline bool DirtEpochEngine::Input(const MemRecord& rec) {
@@ -75,5 +137,44 @@ inline bool DirtEpochEngine::Input(const MemRecord& rec) {
   return true;
 }
 
+inline void DirtEpochEngine::Input(const RecordBatch& batch) {
+  for (uint32_t i = 0; i < batch.size; ++i) {
+    if (batch.ops[i] != 'W') continue;
+    set_overall_ins(batch.ins_seqs[i]);
+    if (NumBlocks() == interval()) NewEpoch();
+    DirtyBlock(batch.mem_addrs[i]);
+  }
+}
+
+// InsEpochEngine
+
+inline InsEpochEngine::InsEpochEngine(int num_ins, bool sliced) :
+    EpochEngine(num_ins), sliced_(sliced), skipping_(sliced), ending_(false),
+    ended_(false), epoch_max_(0), has_first_(false), first_max_(0) {
+}
+
+inline void InsEpochEngine::Write(uint64_t ins_seq, uint64_t mem_addr) {
+  if (ended_) return;
+  if (skipping_ || ending_) {
+    const bool multiple = ins_seq % interval() == 0;
+    if (ending_ && !multiple) {
+      ended_ = true;
+      return;
+    }
+    if (skipping_) {
+      if (multiple) return;
+      skipping_ = false;
+    }
+  }
+  set_overall_ins(ins_seq);
+  if (ins_seq > epoch_max_) {
+    if (epoch_max_) {
+      EndEpoch();
+    }
+    epoch_max_ = (ins_seq / interval() + 1) * interval();
+  }
+  DirtyBlock(mem_addr);
+}
+
 #endif // SEXAIN_EPOCH_ENGINE_H_
 
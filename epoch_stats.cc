@@ -0,0 +1,317 @@
+// epoch_stats.cc
+// Copyright (c) 2014 Jinglei Ren <jinglei.ren@stanzax.org>
+
+#include "epoch_stats.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#define MEGA 1000000
+
+static inline int NumBuckets(int page_bits) {
+  int buckets = 1 << (page_bits - CACHE_BLOCK_BITS);
+  return buckets > 16 ? 16 : buckets;
+}
+
+// DirtTable
+
+void DirtTable::Write(const std::string& prefix,
+    const std::vector<std::string>& notes) const {
+  std::string filename(prefix);
+  filename.append("-").append(std::to_string(interval));
+  filename.append("-").append(std::to_string(page_bits));
+  filename.append(".stats");
+  std::ofstream fout(filename);
+  fout << "# num_epochs=" << num_epochs << std::endl;
+  for (std::vector<std::string>::const_iterator it = notes.begin();
+      it != notes.end(); ++it) {
+    fout << "# " << *it << std::endl;
+  }
+  fout << "# epoch_interval=" << std::fixed << epoch_ins << "M" << std::endl;
+  fout << "# Epoch DR, CDF, Overall DR, Epoch Span" << std::endl;
+  const int buckets = overall_dirts.size();
+  for (int i = 0; i < buckets; ++i) {
+    fout << (double)i / buckets << '\t'
+        << epoch_cdf[i] << '\t'
+        << overall_dirts[i] << '\t'
+        << epoch_spans[i] << std::endl;
+  }
+  fout << 1 << '\t' << epoch_cdf[buckets] << std::endl;
+}
+
+// DirtEpochStats
+
+DirtEpochStats::DirtEpochStats(const std::vector<int>& epochs,
+    const std::vector<int>& page_bits, EpochUnit unit, bool sliced) :
+    page_bits_(page_bits), unit_(unit) {
+  assert(unit == kInstructions || !sliced);
+  for (std::vector<int>::const_iterator it = epochs.begin();
+      it != epochs.end(); ++it) {
+    if (unit == kInstructions) {
+      engines_.push_back(new InsEpochEngine(*it, sliced));
+    } else {
+      engines_.push_back(new DirtEpochEngine(*it));
+    }
+  }
+  pages_.assign(engines_.size(), EpochPages(page_bits, true));
+  for (std::vector<int>::const_iterator it = page_bits.begin();
+      it != page_bits.end(); ++it) {
+    visitors_.push_back(std::vector<PageDirtVisitor>());
+    for (unsigned int i = 0; i < engines_.size(); ++i) {
+      visitors_.back().push_back(PageDirtVisitor(*it, &pages_[i]));
+    }
+  }
+
+  // Register visitors after they are stably allocated, each engine's
+  // pages first for the visitors to read.
+  for (unsigned int i = 0; i < engines_.size(); ++i) {
+    engines_[i]->AddVisitor(&pages_[i]);
+  }
+  for (std::vector< std::vector<PageDirtVisitor> >::iterator it =
+      visitors_.begin(); it != visitors_.end(); ++it) {
+    for (unsigned int i = 0; i < engines_.size(); ++i) {
+      engines_[i]->AddVisitor(&(*it)[i]);
+    }
+  }
+}
+
+DirtEpochStats::~DirtEpochStats() {
+  for (std::vector<EpochEngine*>::iterator it = engines_.begin();
+      it != engines_.end(); ++it) {
+    delete *it;
+  }
+}
+
+void DirtEpochStats::EndSlice() {
+  assert(unit_ == kInstructions);
+  for (std::vector<EpochEngine*>::iterator it = engines_.begin();
+      it != engines_.end(); ++it) {
+    ((InsEpochEngine*)*it)->EndSlice();
+  }
+}
+
+bool DirtEpochStats::slice_ended() const {
+  for (std::vector<EpochEngine*>::const_iterator it = engines_.begin();
+      it != engines_.end(); ++it) {
+    if (!((const InsEpochEngine*)*it)->ended()) return false;
+  }
+  return true;
+}
+
+void DirtEpochStats::Merge(const DirtEpochStats& slice) {
+  assert(unit_ == kInstructions && slice.unit_ == kInstructions &&
+      slice.engines_.size() == engines_.size() &&
+      slice.page_bits_ == page_bits_);
+  for (unsigned int i = 0; i < engines_.size(); ++i) {
+    ((InsEpochEngine*)engines_[i])->Merge(
+        *(const InsEpochEngine*)slice.engines_[i]);
+    pages_[i].Merge(slice.pages_[i]);
+  }
+  for (unsigned int pi = 0; pi < visitors_.size(); ++pi) {
+    for (unsigned int i = 0; i < engines_.size(); ++i) {
+      visitors_[pi][i].Merge(slice.visitors_[pi][i]);
+    }
+  }
+}
+
+void DirtEpochStats::Fill(uint64_t ins_begin,
+    std::vector<DirtTable>* tables) {
+  for (std::vector<EpochEngine*>::iterator it = engines_.begin();
+      it != engines_.end(); ++it) {
+    if ((*it)->num_epochs() == 0) (*it)->NewEpoch();
+  }
+
+  tables->clear();
+  for (unsigned int pi = 0; pi < page_bits_.size(); ++pi) {
+    int buckets = NumBuckets(page_bits_[pi]);
+    std::vector<double> epoch_ratios(buckets);
+    std::vector<double> overall_dirts(buckets);
+    std::vector<double> epochs(buckets);
+    for (unsigned int ei = 0; ei < engines_.size(); ++ei) {
+      PageDirtVisitor& visitor = visitors_[pi][ei];
+      visitor.FillEpochDirts(epoch_ratios.data(), buckets);
+      visitor.FillOverallDirts(overall_dirts.data(), buckets);
+      visitor.FillEpochSpans(epochs.data(), buckets);
+
+      tables->push_back(DirtTable());
+      DirtTable& table = tables->back();
+      table.interval = engines_[ei]->interval();
+      table.page_bits = page_bits_[pi];
+      table.num_epochs = engines_[ei]->num_epochs();
+      const uint64_t window_ins = engines_[ei]->overall_ins() > ins_begin ?
+          engines_[ei]->overall_ins() - ins_begin : 0;
+      table.epoch_ins = (double)window_ins / MEGA / table.num_epochs;
+      double left_sum = 0;
+      for (int i = 0; i < buckets; ++i) {
+        table.epoch_cdf.push_back(left_sum);
+        table.overall_dirts.push_back(
+            overall_dirts[i] / visitor.page_blocks());
+        table.epoch_spans.push_back(epochs[i] / table.num_epochs);
+        left_sum += epoch_ratios[i];
+      }
+      table.epoch_cdf.push_back(left_sum);
+    }
+  }
+}
+
+void DirtEpochStats::Write(const std::string& prefix, uint64_t ins_begin,
+    const std::vector<std::string>& notes) {
+  std::vector<DirtTable> tables;
+  Fill(ins_begin, &tables);
+  for (std::vector<DirtTable>::iterator it = tables.begin();
+      it != tables.end(); ++it) {
+    it->Write(prefix, notes);
+  }
+}
+
+
+// ParallelEpochStats
+
+ParallelEpochStats::ParallelEpochStats(DirtEpochStats* stats, int num_workers,
+    uint32_t block_records, int max_blocks) : stats_(stats),
+    block_records_(block_records), max_blocks_(max_blocks), filling_(NULL),
+    first_block_(0), next_blocks_(stats->num_engines(), 0),
+    busy_(stats->num_engines(), false), stopping_(false) {
+  for (int i = 0; i < max_blocks_; ++i) {
+    Block* block = new Block;
+    block->ins_seqs.resize(block_records_);
+    block->mem_addrs.resize(block_records_);
+    block->ops.resize(block_records_);
+    block->size = 0;
+    block->readers = 0;
+    free_.push_back(block);
+  }
+  num_workers = std::min(num_workers, stats->num_engines());
+  for (int i = 0; i < num_workers; ++i) {
+    workers_.push_back(std::thread(&ParallelEpochStats::Run, this));
+  }
+}
+
+ParallelEpochStats::~ParallelEpochStats() {
+  Finish();
+  for (std::vector<Block*>::iterator it = free_.begin(); it != free_.end();
+      ++it) {
+    delete *it;
+  }
+}
+
+void ParallelEpochStats::Input(const RecordBatch& batch) {
+  if (workers_.empty()) {
+    stats_->Input(batch);
+    return;
+  }
+  uint32_t i = 0;
+  while (i < batch.size) {
+    if (!filling_) filling_ = NewBlock();
+    const uint32_t n =
+        std::min(batch.size - i, block_records_ - filling_->size);
+    memcpy(filling_->ins_seqs.data() + filling_->size, batch.ins_seqs + i,
+        sizeof(uint64_t) * n);
+    memcpy(filling_->mem_addrs.data() + filling_->size, batch.mem_addrs + i,
+        sizeof(uint64_t) * n);
+    memcpy(filling_->ops.data() + filling_->size, batch.ops + i, n);
+    filling_->size += n;
+    i += n;
+    if (filling_->size == block_records_) Publish();
+  }
+}
+
+void ParallelEpochStats::Finish() {
+  if (filling_) Publish();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  work_cond_.notify_all();
+  for (std::vector<std::thread>::iterator it = workers_.begin();
+      it != workers_.end(); ++it) {
+    it->join();
+  }
+  workers_.clear();
+}
+
+// Takes a free block, waiting for the slowest engine if there is none.
+ParallelEpochStats::Block* ParallelEpochStats::NewBlock() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (free_.empty()) free_cond_.wait(lock);
+  Block* block = free_.back();
+  free_.pop_back();
+  block->size = 0;
+  return block;
+}
+
+void ParallelEpochStats::Publish() {
+  Block* block = filling_;
+  filling_ = NULL;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (block->size == 0) {
+      free_.push_back(block);
+      return;
+    }
+    block->readers = stats_->num_engines();
+    blocks_.push_back(block);
+  }
+  work_cond_.notify_all();
+}
+
+// Returns the idle engine with the most blocks left, or -1 if none has any.
+// Requires mutex_ held.
+int ParallelEpochStats::PickEngine() const {
+  const uint64_t end = first_block_ + blocks_.size();
+  int engine = -1;
+  for (unsigned int i = 0; i < busy_.size(); ++i) {
+    if (busy_[i] || next_blocks_[i] == end) continue;
+    if (engine < 0 || next_blocks_[i] < next_blocks_[engine]) engine = i;
+  }
+  return engine;
+}
+
+// Runs an engine over all blocks published for it, and then another.
+void ParallelEpochStats::Run() {
+  std::vector<Block*> blocks;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    const int engine = PickEngine();
+    if (engine < 0) {
+      // Engines being run are caught up by their workers.
+      if (stopping_) return;
+      work_cond_.wait(lock);
+      continue;
+    }
+    busy_[engine] = true;
+    const uint64_t begin = next_blocks_[engine];
+    const uint64_t end = first_block_ + blocks_.size();
+    blocks.assign(blocks_.begin() + (begin - first_block_), blocks_.end());
+    lock.unlock();
+
+    for (std::vector<Block*>::iterator it = blocks.begin();
+        it != blocks.end(); ++it) {
+      RecordBatch batch;
+      batch.ins_seqs = (*it)->ins_seqs.data();
+      batch.mem_addrs = (*it)->mem_addrs.data();
+      batch.ops = (*it)->ops.data();
+      batch.size = (*it)->size;
+      batch.thread_id = 0;
+      stats_->Input(engine, batch);
+    }
+
+    lock.lock();
+    next_blocks_[engine] = end;
+    busy_[engine] = false;
+    for (std::vector<Block*>::iterator it = blocks.begin();
+        it != blocks.end(); ++it) {
+      --(*it)->readers;
+    }
+    bool freed = false;
+    while (!blocks_.empty() && blocks_.front()->readers == 0) {
+      free_.push_back(blocks_.front());
+      blocks_.pop_front();
+      ++first_block_;
+      freed = true;
+    }
+    if (freed) free_cond_.notify_one();
+    work_cond_.notify_all(); // the engine may have more blocks by now
+  }
+}
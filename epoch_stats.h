@@ -0,0 +1,164 @@
+// epoch_stats.h
+// Copyright (c) 2014 Jinglei Ren <jinglei.ren@stanzax.org>
+
+#ifndef SEXAIN_EPOCH_STATS_H_
+#define SEXAIN_EPOCH_STATS_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "epoch_engine.h"
+#include "epoch_visitor.h"
+
+// Units of epoch intervals
+enum EpochUnit {
+  kDirtyBlocks, // by DirtEpochEngine
+  kInstructions // by InsEpochEngine
+};
+
+// Page dirtiness at one epoch interval and page size, in buckets of dirty
+// ratios, as in a .stats file
+struct DirtTable {
+  int interval;
+  int page_bits;
+  int num_epochs;
+  double epoch_ins; // in millions, on average
+  std::vector<double> epoch_cdf; // epochs below each bucket, and in all
+  std::vector<double> overall_dirts; // ratio of pages in each bucket
+  std::vector<double> epoch_spans; // of pages in each bucket, per epoch
+
+  // Writes <prefix>-<interval>-<page bits>.stats, with the notes as extra
+  // comment lines.
+  void Write(const std::string& prefix,
+      const std::vector<std::string>& notes) const;
+};
+
+// Page dirtiness over epochs of the given numbers of dirty blocks (or
+// instructions), at the given page sizes, as reported by MemAddrStats.
+// Records are fed by Input() either from a trace or live from the Pintool.
+//
+// Epochs of instructions can be counted over slices of a trace in parallel,
+// each by stats of its own, which are sliced unless for the first slice.
+// Each but the last slice is fed on after EndSlice() until slice_ended()
+// (see InsEpochEngine). Merging the slices in order into the first yields
+// the same as feeding it the whole trace.
+class DirtEpochStats {
+ public:
+  DirtEpochStats(const std::vector<int>& epochs,
+      const std::vector<int>& page_bits, EpochUnit unit = kDirtyBlocks,
+      bool sliced = false);
+  ~DirtEpochStats();
+
+  void Input(const MemRecord& rec);
+  void Input(const RecordBatch& batch);
+  // Feeds only the given engine and its visitors, which share no state
+  // with other engines.
+  void Input(int engine, const RecordBatch& batch);
+  int num_engines() const { return engines_.size(); }
+  // Lets the engines take late records of a followed trace.
+  void AllowLateRecords();
+  void EndSlice();
+  bool slice_ended() const;
+  // Continues with the stats of the slice that follows the records input
+  // so far, in instructions.
+  void Merge(const DirtEpochStats& slice);
+  // Ends the input and fills a table for every pair of epoch interval and
+  // page size. ins_begin is where the input started.
+  void Fill(uint64_t ins_begin, std::vector<DirtTable>* tables);
+  // Writes the tables filled as above.
+  void Write(const std::string& prefix, uint64_t ins_begin,
+      const std::vector<std::string>& notes);
+
+ private:
+  DirtEpochStats(const DirtEpochStats&); // visitors are registered by address
+
+  std::vector<int> page_bits_;
+  const EpochUnit unit_;
+  std::vector<EpochEngine*> engines_; // all owned
+  std::vector<EpochPages> pages_; // of each engine, shared by page sizes
+  std::vector< std::vector<PageDirtVisitor> > visitors_;
+};
+
+// Runs the engines of a DirtEpochStats on worker threads. Each batch is
+// copied once into a block of records shared by all engines, which consume
+// the blocks in order. An idle worker takes up whichever engine is furthest
+// behind, so engines of different costs keep all workers busy. Engines see
+// the same records as they do serially, so the results are the same.
+//
+// Up to max_blocks blocks are in flight, after which Input() waits for the
+// slowest engine. Without workers, batches are fed to the engines inline.
+class ParallelEpochStats {
+ public:
+  ParallelEpochStats(DirtEpochStats* stats, int num_workers,
+      uint32_t block_records = kBlockRecords, int max_blocks = kMaxBlocks);
+  ~ParallelEpochStats();
+
+  void Input(const RecordBatch& batch);
+  // Waits until all engines have consumed all records.
+  void Finish();
+
+  static const uint32_t kBlockRecords = 1 << 16;
+  static const int kMaxBlocks = 16;
+
+ private:
+  struct Block {
+    std::vector<uint64_t> ins_seqs;
+    std::vector<uint64_t> mem_addrs;
+    std::vector<char> ops;
+    uint32_t size;
+    int readers; // engines yet to consume it
+  };
+
+  void Run();
+  void Publish();
+  Block* NewBlock();
+  int PickEngine() const;
+
+  DirtEpochStats* const stats_;
+  const uint32_t block_records_;
+  const int max_blocks_;
+  Block* filling_; // not yet published, or NULL
+
+  std::mutex mutex_; // guards all below
+  std::condition_variable work_cond_;
+  std::condition_variable free_cond_;
+  std::deque<Block*> blocks_; // published and not yet consumed by all
+  uint64_t first_block_; // sequence of the front of blocks_
+  std::vector<Block*> free_;
+  std::vector<uint64_t> next_blocks_; // to be consumed by each engine
+  std::vector<bool> busy_; // engines being run by a worker
+  bool stopping_;
+  std::vector<std::thread> workers_;
+};
+
+inline void DirtEpochStats::AllowLateRecords() {
+  for (std::vector<EpochEngine*>::iterator it = engines_.begin();
+      it != engines_.end(); ++it) {
+    (*it)->AllowLateRecords();
+  }
+}
+
+inline void DirtEpochStats::Input(const MemRecord& rec) {
+  for (std::vector<EpochEngine*>::iterator it = engines_.begin();
+      it != engines_.end(); ++it) {
+    (*it)->Input(rec);
+  }
+}
+
+inline void DirtEpochStats::Input(const RecordBatch& batch) {
+  for (std::vector<EpochEngine*>::iterator it = engines_.begin();
+      it != engines_.end(); ++it) {
+    (*it)->Input(batch);
+  }
+}
+
+inline void DirtEpochStats::Input(int engine, const RecordBatch& batch) {
+  engines_[engine]->Input(batch);
+}
+
+#endif // SEXAIN_EPOCH_STATS_H_
+
@@ -3,23 +3,96 @@
 
 #include "epoch_visitor.h"
 
+#include <algorithm>
+
+// EpochPages
+
+EpochPages::EpochPages(const std::vector<int>& page_bits,
+    bool keeps_overall) : page_bits_(page_bits),
+    keeps_overall_(keeps_overall) {
+  std::sort(page_bits_.begin(), page_bits_.end());
+  page_bits_.erase(std::unique(page_bits_.begin(), page_bits_.end()),
+      page_bits_.end());
+  pages_.resize(page_bits_.size());
+}
+
+void EpochPages::Visit(const BlockSet& blocks) {
+  if (keeps_overall_) {
+    for (BlockSet::const_iterator it = blocks.begin(); it != blocks.end();
+        ++it) {
+      overall_blocks_.insert(*it);
+    }
+  }
+  if (page_bits_.empty()) return;
+  sorted_.assign(blocks.begin(), blocks.end());
+  std::sort(sorted_.begin(), sorted_.end());
+
+  // Count how many blocks of a page are dirty within an epoch
+  PageList* pages = &pages_[0];
+  pages->clear();
+  int shift = page_bits_[0] - CACHE_BLOCK_BITS;
+  for (std::vector<uint64_t>::const_iterator it = sorted_.begin();
+      it != sorted_.end(); ++it) {
+    const uint64_t index = *it >> shift;
+    if (pages->empty() || pages->back().index != index) {
+      const Page page = { index, 0 };
+      pages->push_back(page);
+    }
+    ++pages->back().blocks;
+  }
+  // and merge the pages into larger ones
+  for (unsigned int i = 1; i < page_bits_.size(); ++i) {
+    const PageList& smaller = pages_[i - 1];
+    pages = &pages_[i];
+    pages->clear();
+    shift = page_bits_[i] - page_bits_[i - 1];
+    for (PageList::const_iterator it = smaller.begin(); it != smaller.end();
+        ++it) {
+      const uint64_t index = it->index >> shift;
+      if (pages->empty() || pages->back().index != index) {
+        const Page page = { index, 0 };
+        pages->push_back(page);
+      }
+      pages->back().blocks += it->blocks;
+    }
+  }
+}
+
+void EpochPages::Merge(const EpochPages& other) {
+  assert(keeps_overall_ && other.keeps_overall_);
+  for (BlockSet::const_iterator it = other.overall_blocks_.begin();
+      it != other.overall_blocks_.end(); ++it) {
+    overall_blocks_.insert(*it);
+  }
+}
+
+const EpochPages::PageList& EpochPages::pages(int page_bits) const {
+  const std::vector<int>::const_iterator it =
+      std::lower_bound(page_bits_.begin(), page_bits_.end(), page_bits);
+  assert(it != page_bits_.end() && *it == page_bits);
+  return pages_[it - page_bits_.begin()];
+}
+
 // EpochDirtVisitor
 
 void EpochDirtVisitor::Visit(const BlockSet& blocks) {
   PageVisitor::Visit(blocks);
-  page_dirts_.clear();
-  // Count how many blocks of a page are dirty within an epoch
-  for (BlockSet::const_iterator it = blocks.begin();
-      it != blocks.end(); ++it) {
-    assert((page_dirts_[(*it) >> (page_bits() - CACHE_BLOCK_BITS)] += 1)
-        <= page_blocks());
+  if (!shared_pages_) own_pages_.Visit(blocks);
+  for (PageDirts::const_iterator it = page_dirts().begin();
+      it != page_dirts().end(); ++it) {
+    assert(it->blocks <= page_blocks());
+    dirt_pages_[it->blocks - 1] += 1;
+    ++page_accum_;
   }
+}
 
-  for (PageDirts::iterator it = page_dirts_.begin();
-      it != page_dirts_.end(); ++it) {
-    dirt_pages_[it->second - 1] += 1;
-    ++page_accum_;
+void EpochDirtVisitor::Merge(const EpochDirtVisitor& other) {
+  assert(page_bits() == other.page_bits());
+  PageVisitor::Merge(other);
+  for (int i = 0; i < page_blocks(); ++i) {
+    dirt_pages_[i] += other.dirt_pages_[i];
   }
+  page_accum_ += other.page_accum_;
 }
 
 int EpochDirtVisitor::FillEpochDirts(double ratios[], const int n) const {
@@ -40,12 +113,22 @@ void PageStatsVisitor::Visit(const BlockSet& blocks) {
   EpochDirtVisitor::Visit(blocks);
   for (PageDirts::const_iterator it = page_dirts().begin();
       it != page_dirts().end(); ++it) {
-    DirtyStats& stats = page_stats_[it->first];
-    stats.blocks += it->second;
+    DirtyStats& stats = page_stats_[it->index];
+    stats.blocks += it->blocks;
     stats.epochs += 1;
   }
 }
 
+void PageStatsVisitor::Merge(const PageStatsVisitor& other) {
+  EpochDirtVisitor::Merge(other);
+  for (PageStats::const_iterator it = other.page_stats_.begin();
+      it != other.page_stats_.end(); ++it) {
+    DirtyStats& stats = page_stats_[it->first];
+    stats.blocks += it->second.blocks;
+    stats.epochs += it->second.epochs;
+  }
+}
+
 int PageStatsVisitor::FillEpochSpans(double epochs[], const int n) const {
   assert(page_blocks() % n == 0);
   for (int i = 0; i < n; ++i) epochs[i] = 0.0;
@@ -76,19 +159,18 @@ int PageDirtVisitor::FillOverallDirts(double dirts[], const int n) const {
   assert(page_blocks() % n == 0);
   for (int i = 0; i < n; ++i) dirts[i] = 0.0;
 
-  PageDirts overall_page_dirts;
-  for (BlockSet::const_iterator it = overall_blocks_.begin();
-      it != overall_blocks_.end(); ++it) {
-    overall_page_dirts[(*it) >> (page_bits() - CACHE_BLOCK_BITS)] += 1;
-  }
+  EpochPages overall(std::vector<int>(1, page_bits()));
+  overall.Visit(shared_pages() ? shared_pages()->overall_blocks() :
+      overall_blocks_);
+  const PageDirts& overall_page_dirts = overall.pages(page_bits());
 
   std::vector<int> num_pages(n, 0);
   int unit = page_blocks() / n;
   for (PageDirts::const_iterator it = overall_page_dirts.begin();
       it != overall_page_dirts.end(); ++it) {
-    DirtyStats stats = StatsOf(it->first);
+    DirtyStats stats = StatsOf(it->index);
     int bi = (stats.blocks / stats.epochs - 1) / unit;
-    dirts[bi] += it->second;
+    dirts[bi] += it->blocks;
     num_pages[bi] += 1;
   }
 
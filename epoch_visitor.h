@@ -7,23 +7,55 @@
 #include <cstdint>
 #include <vector>
 #include <unordered_map>
-#include <unordered_set>
 #include <iostream>
 #include <cassert>
+#include "block_set.h"
 
 #define CACHE_BLOCK_BITS 6
 
-typedef std::unordered_set<uint64_t> BlockSet;
-
 class EpochVisitor {
  public:
   virtual void Visit(const BlockSet& dirty_blocks) = 0;
 };
 
+// Counts the dirty blocks of an epoch by page, for several page sizes at
+// once. Blocks are sorted once, so the pages of the smallest size come as
+// runs of blocks, and those of each larger size as runs of smaller pages.
+// Registered before the visitors that read the counts, it is shared by all
+// visitors of an engine, and may keep the blocks dirty in any epoch for them.
+class EpochPages : public EpochVisitor {
+ public:
+  struct Page {
+    uint64_t index;
+    int blocks; // dirty ones
+  };
+  typedef std::vector<Page> PageList; // in order of index
+
+  explicit EpochPages(const std::vector<int>& page_bits,
+      bool keeps_overall = false);
+  void Visit(const BlockSet& blocks);
+  // Adds the overall blocks of another one, e.g., of a slice of the trace.
+  void Merge(const EpochPages& other);
+  // Pages of the given size counted in the last visit
+  const PageList& pages(int page_bits) const;
+  bool keeps_overall() const { return keeps_overall_; }
+  const BlockSet& overall_blocks() const { return overall_blocks_; }
+
+ private:
+  std::vector<int> page_bits_; // in increasing order
+  std::vector<PageList> pages_; // of each page size
+  std::vector<uint64_t> sorted_;
+  bool keeps_overall_;
+  BlockSet overall_blocks_;
+};
+
 class PageVisitor : public EpochVisitor {
  public:
   PageVisitor(int page_bits);
   virtual void Visit(const BlockSet& blocks) { ++num_visits_; }
+  // Adds what another visitor of the same page size has seen, as if its
+  // epochs were visited by this one. Subclasses merge their own state.
+  void Merge(const PageVisitor& other) { num_visits_ += other.num_visits_; }
   int page_bits() const { return page_bits_; }
   int page_blocks() const { return page_blocks_; }
   int num_visits() const { assert(num_visits_ >= 0); return num_visits_; }
@@ -33,24 +65,31 @@ class PageVisitor : public EpochVisitor {
   int num_visits_;
 };
 
+// Takes the dirty pages of each epoch from the shared EpochPages if given,
+// or else counts them on its own.
 class EpochDirtVisitor : public PageVisitor {
  public:
-  EpochDirtVisitor(int page_bits);
+  EpochDirtVisitor(int page_bits, const EpochPages* pages = NULL);
   void Visit(const BlockSet& blocks);
+  void Merge(const EpochDirtVisitor& other);
   int FillEpochDirts(double dirts[], const int num_buckets) const;
  protected:
-  typedef std::unordered_map<uint64_t, int> PageDirts;
-  const PageDirts& page_dirts() const { return page_dirts_; }
+  typedef EpochPages::PageList PageDirts;
+  const PageDirts& page_dirts() const;
+  const EpochPages* shared_pages() const { return shared_pages_; }
  private:
-  PageDirts page_dirts_;
+  const EpochPages* shared_pages_;
+  EpochPages own_pages_;
   std::vector<unsigned int> dirt_pages_;
   unsigned int page_accum_;
 };
 
 class PageStatsVisitor : public EpochDirtVisitor {
  public:
-  PageStatsVisitor(int page_bits) : EpochDirtVisitor(page_bits) { }
+  PageStatsVisitor(int page_bits, const EpochPages* pages = NULL) :
+      EpochDirtVisitor(page_bits, pages) { }
   void Visit(const BlockSet& blocks);
+  void Merge(const PageStatsVisitor& other);
   int FillEpochSpans(double avg_epochs[], const int num_buckets) const;
  protected:
   struct DirtyStats {
@@ -64,10 +103,17 @@ class PageStatsVisitor : public EpochDirtVisitor {
   PageStats page_stats_;
 };
 
+// Takes the blocks dirty in any epoch from the shared EpochPages if given,
+// which then has to keep them.
 class PageDirtVisitor : public PageStatsVisitor {
  public:
-  PageDirtVisitor(int page_bits) : PageStatsVisitor(page_bits) { }
+  PageDirtVisitor(int page_bits, const EpochPages* pages = NULL) :
+      PageStatsVisitor(page_bits, pages) {
+    assert(!pages || pages->keeps_overall());
+  }
   void Visit(const BlockSet& blocks);
+  // Overall blocks are merged by the shared EpochPages if there is one.
+  void Merge(const PageDirtVisitor& other);
   int FillOverallDirts(double dirts[], const int num_buckets) const;
  private:
   BlockSet overall_blocks_;
@@ -86,11 +132,18 @@ inline PageVisitor::PageVisitor(int page_bits) :
 
 // EpochDirtVisitor
 
-inline EpochDirtVisitor::EpochDirtVisitor(int page_bits) :
-    PageVisitor(page_bits), dirt_pages_(page_blocks(), 0) {
+inline EpochDirtVisitor::EpochDirtVisitor(int page_bits,
+    const EpochPages* pages) : PageVisitor(page_bits), shared_pages_(pages),
+    own_pages_(std::vector<int>(pages ? 0 : 1, page_bits)),
+    dirt_pages_(page_blocks(), 0) {
   page_accum_ = 0;
 }
 
+inline const EpochDirtVisitor::PageDirts& EpochDirtVisitor::page_dirts()
+    const {
+  return (shared_pages_ ? shared_pages_ : &own_pages_)->pages(page_bits());
+}
+
 // PageStatsVisitor
 
 inline PageStatsVisitor::DirtyStats PageStatsVisitor::StatsOf(
@@ -104,10 +157,20 @@ inline PageStatsVisitor::DirtyStats PageStatsVisitor::StatsOf(
 
 inline void PageDirtVisitor::Visit(const BlockSet& blocks) {
   PageStatsVisitor::Visit(blocks);
+  if (shared_pages()) return;
   for (BlockSet::const_iterator it = blocks.begin(); it != blocks.end(); ++it) {
     overall_blocks_.insert(*it);
   }
 }
 
+inline void PageDirtVisitor::Merge(const PageDirtVisitor& other) {
+  PageStatsVisitor::Merge(other);
+  if (shared_pages()) return;
+  for (BlockSet::const_iterator it = other.overall_blocks_.begin();
+      it != other.overall_blocks_.end(); ++it) {
+    overall_blocks_.insert(*it);
+  }
+}
+
 #endif // SEXAIN_EPOCH_VISITOR_H_
 
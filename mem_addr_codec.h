@@ -0,0 +1,199 @@
+// mem_addr_codec.h
+// Copyright (c) 2014 Jinglei Ren <jinglei.ren@stanzax.org>
+
+#ifndef SEXAIN_MEM_ADDR_CODEC_H_
+#define SEXAIN_MEM_ADDR_CODEC_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include "zlib.h"
+#ifdef HAVE_LZ4
+#include "lz4.h"
+#endif
+#ifdef HAVE_ZSTD
+#include "zstd.h"
+#endif
+
+// Compression of trace blocks. The codec of a trace is recorded in its
+// header, and traces written before codecs were selectable are all zlib,
+// hence zlib is codec 0. LZ4 and zstd are available only when built with
+// HAVE_LZ4 or HAVE_ZSTD.
+enum TraceCodec {
+  kCodecZlib = 0,
+  kCodecNone = 1,
+  kCodecLz4 = 2,
+  kCodecZstd = 3
+};
+
+class BlockCodec {
+ public:
+  BlockCodec(TraceCodec id = kCodecZlib, int level = kDefaultLevel) :
+      id_(id), level_(level) { }
+
+  TraceCodec id() const { return id_; }
+  int level() const { return level_; }
+  const char* name() const { return Name(id_); }
+  bool is_available() const { return IsAvailable(id_); }
+
+  // Upper bound of the compressed size of a block of the given bytes
+  size_t Bound(size_t bytes) const;
+  // On input, *dst_len is the capacity of dst; on success, the bytes used.
+  bool Compress(void* dst, size_t* dst_len,
+      const void* src, size_t src_len) const;
+  bool Decompress(void* dst, size_t* dst_len,
+      const void* src, size_t src_len) const;
+
+  // Accepts "none", "zlib", "lz4" and "zstd", optionally with ":LEVEL".
+  static bool Parse(const char* spec, BlockCodec* codec);
+  static const char* Name(TraceCodec id);
+  static bool IsAvailable(TraceCodec id);
+
+  static const int kDefaultLevel = -1; // the codec's own default
+
+ private:
+  TraceCodec id_;
+  int level_;
+};
+
+inline const char* BlockCodec::Name(TraceCodec id) {
+  switch (id) {
+    case kCodecZlib: return "zlib";
+    case kCodecNone: return "none";
+    case kCodecLz4: return "lz4";
+    case kCodecZstd: return "zstd";
+  }
+  return "unknown";
+}
+
+inline bool BlockCodec::IsAvailable(TraceCodec id) {
+  switch (id) {
+    case kCodecZlib:
+    case kCodecNone:
+      return true;
+#ifdef HAVE_LZ4
+    case kCodecLz4:
+      return true;
+#endif
+#ifdef HAVE_ZSTD
+    case kCodecZstd:
+      return true;
+#endif
+    default:
+      return false;
+  }
+}
+
+inline bool BlockCodec::Parse(const char* spec, BlockCodec* codec) {
+  const char* colon = strchr(spec, ':');
+  const size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+  int level = kDefaultLevel;
+  if (colon) {
+    char* end;
+    level = strtol(colon + 1, &end, 10);
+    if (end == colon + 1 || *end) return false;
+  }
+  const TraceCodec ids[] = { kCodecZlib, kCodecNone, kCodecLz4, kCodecZstd };
+  for (size_t i = 0; i < sizeof(ids) / sizeof(ids[0]); ++i) {
+    if (strlen(Name(ids[i])) == len && strncmp(spec, Name(ids[i]), len) == 0) {
+      *codec = BlockCodec(ids[i], level);
+      return true;
+    }
+  }
+  return false;
+}
+
+inline size_t BlockCodec::Bound(size_t bytes) const {
+  switch (id_) {
+    case kCodecZlib: return compressBound(bytes);
+#ifdef HAVE_LZ4
+    case kCodecLz4: return LZ4_compressBound(bytes);
+#endif
+#ifdef HAVE_ZSTD
+    case kCodecZstd: return ZSTD_compressBound(bytes);
+#endif
+    default: return bytes;
+  }
+}
+
+inline bool BlockCodec::Compress(void* dst, size_t* dst_len,
+    const void* src, size_t src_len) const {
+  switch (id_) {
+    case kCodecZlib: {
+      uLongf len = *dst_len;
+      if (compress2((Bytef*)dst, &len, (const Bytef*)src, src_len,
+          level_ == kDefaultLevel ? Z_DEFAULT_COMPRESSION : level_) != Z_OK) {
+        return false;
+      }
+      *dst_len = len;
+      return true;
+    }
+    case kCodecNone:
+      if (src_len > *dst_len) return false;
+      memcpy(dst, src, src_len);
+      *dst_len = src_len;
+      return true;
+#ifdef HAVE_LZ4
+    case kCodecLz4: {
+      const int len = LZ4_compress_default((const char*)src, (char*)dst,
+          src_len, *dst_len);
+      if (len <= 0) return false;
+      *dst_len = len;
+      return true;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case kCodecZstd: {
+      const size_t len = ZSTD_compress(dst, *dst_len, src, src_len,
+          level_ == kDefaultLevel ? 1 : level_);
+      if (ZSTD_isError(len)) return false;
+      *dst_len = len;
+      return true;
+    }
+#endif
+    default:
+      return false;
+  }
+}
+
+inline bool BlockCodec::Decompress(void* dst, size_t* dst_len,
+    const void* src, size_t src_len) const {
+  switch (id_) {
+    case kCodecZlib: {
+      uLongf len = *dst_len;
+      if (uncompress((Bytef*)dst, &len, (const Bytef*)src, src_len) != Z_OK) {
+        return false;
+      }
+      *dst_len = len;
+      return true;
+    }
+    case kCodecNone:
+      if (src_len > *dst_len) return false;
+      memcpy(dst, src, src_len);
+      *dst_len = src_len;
+      return true;
+#ifdef HAVE_LZ4
+    case kCodecLz4: {
+      const int len = LZ4_decompress_safe((const char*)src, (char*)dst,
+          src_len, *dst_len);
+      if (len < 0) return false;
+      *dst_len = len;
+      return true;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case kCodecZstd: {
+      const size_t len = ZSTD_decompress(dst, *dst_len, src, src_len);
+      if (ZSTD_isError(len)) return false;
+      *dst_len = len;
+      return true;
+    }
+#endif
+    default:
+      return false;
+  }
+}
+
+#endif // SEXAIN_MEM_ADDR_CODEC_H_
+
@@ -0,0 +1,230 @@
+// mem_addr_format.h
+// Copyright (c) 2014 Jinglei Ren <jinglei.ren@stanzax.org>
+
+#ifndef SEXAIN_MEM_ADDR_FORMAT_H_
+#define SEXAIN_MEM_ADDR_FORMAT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// On-disk layout shared by MemAddrTrace (writer) and MemAddrParser (reader).
+//
+// Legacy traces (version 0) begin with the buffer length and pointer width,
+// followed by chunks of three length-prefixed zlib blocks (ins, addr, op).
+// Versioned traces begin with TraceHeader instead, and every chunk is
+// preceded by a ChunkHeader naming the thread that produced it.
+//
+// Version 1 keeps the three raw columns. Version 2 transforms them before
+// compression: instruction sequences become zigzag varints of their deltas,
+// and address deltas are split into ptr_bytes byte planes, each of which is
+// a block of its own. A chunk is then ins, addr planes..., op.
+// Deltas restart at every chunk, so chunks decode independently.
+//
+// Version 3 packs the op column into a bitmap (bit set for a write) and
+// groups the records of a chunk into a write stream and a read stream,
+// each an ins block plus ptr_bytes addr plane blocks. A chunk is then
+// op bitmap, write ins, write addr planes..., read ins, read addr planes...
+// The bitmap restores the original order, and readers interested only in
+// writes skip the bitmap and the read stream altogether.
+//
+// Version 4 records in the header the codec that compressed the blocks
+// (see mem_addr_codec.h). Earlier versions are all zlib.
+//
+// Version 5 ends a file closed properly with a chunk index: an entry per
+// chunk, followed by IndexTrailer. A reader that finds no trailer, e.g.,
+// after a crash, takes the chunks to run to the end of the file.
+//
+// Version 6 keeps instruction sequences in 64 bits. Each ChunkHeader holds
+// the first one of the chunk as base_ins, and the ins blocks hold zigzag
+// varints of 64-bit deltas starting from it. Earlier versions keep only
+// the low 32 bits, which readers extend assuming they never go backwards.
+//
+// Index entries have since grown the number of writes and the address
+// bounds of their chunks, so readers can skip chunks without a record of
+// interest. Entries of older writers are shorter, and readers take their
+// chunks to span all addresses.
+//
+// A chunk without records announces a thread when it starts, to readers
+// following a file as it is written. It is left out of the index.
+
+const uint32_t kTraceMagic = 0x52545853; // "SXTR" in little endian
+const uint32_t kTraceVersion = 6;
+
+struct TraceHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t buffer_length;
+  uint32_t ptr_bytes;
+  uint32_t header_size; // bytes of this header, so fields can be appended
+  uint32_t codec; // TraceCodec, since version 4
+  int32_t codec_level;
+  // Line bytes and entries of the LineFilter the records went through,
+  // or zero if none did.
+  uint32_t filter_line;
+  uint32_t filter_entries;
+};
+
+struct ChunkHeader {
+  uint32_t thread_id;
+  uint32_t num_records;
+  uint32_t num_writes; // since version 3
+  uint32_t reserved; // since version 6, as are the fields below
+  uint64_t base_ins;
+};
+
+const uint32_t kIndexMagic = 0x58495853; // "SXIX" in little endian
+
+struct ChunkIndexEntry {
+  uint64_t offset; // of the ChunkHeader in the file
+  uint64_t first_ins;
+  uint64_t last_ins;
+  uint32_t thread_id;
+  uint32_t num_records;
+  uint32_t num_writes; // since the fields below were appended
+  uint32_t reserved;
+  uint64_t min_addr;
+  uint64_t max_addr;
+};
+
+struct IndexTrailer {
+  uint64_t index_offset; // where the chunks end and the entries begin
+  uint64_t num_entries;
+  uint32_t entry_size; // bytes of each entry, so fields can be appended
+  uint32_t magic;
+};
+
+const int kMaxVarintBytes32 = 5;
+const int kMaxVarintBytes64 = 10;
+
+inline size_t ChunkHeaderSize(const TraceHeader& header) {
+  if (header.version < 3) return offsetof(ChunkHeader, num_writes);
+  if (header.version < 6) return offsetof(ChunkHeader, reserved);
+  return sizeof(ChunkHeader);
+}
+
+// Upper bound of the bytes of an encoded ins column of n records
+inline size_t MaxInsColumnBytes(const TraceHeader& header, uint32_t n) {
+  return (size_t)n * (header.version < 6 ? kMaxVarintBytes32 :
+      kMaxVarintBytes64);
+}
+
+// Number of length-prefixed blocks in each chunk
+inline int NumChunkBlocks(const TraceHeader& header) {
+  if (header.version < 2) return 3;
+  if (header.version < 3) return 2 + header.ptr_bytes;
+  return 1 + 2 * (1 + header.ptr_bytes);
+}
+
+// Index of the first block of the write (or read) stream in version 3
+inline int StreamBlock(const TraceHeader& header, bool is_write) {
+  return is_write ? 1 : 2 + header.ptr_bytes;
+}
+
+inline int32_t UnZigZag32(uint32_t v) {
+  return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+inline uint64_t ZigZag64(int64_t v) {
+  return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+inline int64_t UnZigZag64(uint64_t v) {
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+// Writes n instruction sequences as zigzag varints of their deltas,
+// starting from base. Returns the number of bytes written,
+// at most n * kMaxVarintBytes64.
+inline size_t EncodeInsColumn(const uint64_t* ins, uint32_t n, uint64_t base,
+    uint8_t* out) {
+  uint8_t* p = out;
+  uint64_t prev = base;
+  for (uint32_t i = 0; i < n; ++i) {
+    uint64_t v = ZigZag64((int64_t)(ins[i] - prev));
+    prev = ins[i];
+    while (v >= 0x80) {
+      *p++ = (uint8_t)(v | 0x80);
+      v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+  }
+  return p - out;
+}
+
+// Returns false if the input does not hold exactly n varints.
+inline bool DecodeInsColumn(const uint8_t* in, size_t len, uint64_t base,
+    uint64_t* ins, uint32_t n) {
+  const uint8_t* p = in;
+  const uint8_t* end = in + len;
+  uint64_t prev = base;
+  for (uint32_t i = 0; i < n; ++i) {
+    uint64_t v = 0;
+    for (int shift = 0; ; shift += 7) {
+      if (p == end || shift >= 7 * kMaxVarintBytes64) return false;
+      const uint8_t b = *p++;
+      v |= (uint64_t)(b & 0x7f) << shift;
+      if (!(b & 0x80)) break;
+    }
+    prev += (uint64_t)UnZigZag64(v);
+    ins[i] = prev;
+  }
+  return p == end;
+}
+
+// Decodes the 32-bit deltas of versions 2 to 5, which start from 0.
+inline bool DecodeInsColumn32(const uint8_t* in, size_t len,
+    uint64_t* ins, uint32_t n) {
+  const uint8_t* p = in;
+  const uint8_t* end = in + len;
+  uint32_t prev = 0;
+  for (uint32_t i = 0; i < n; ++i) {
+    uint32_t v = 0;
+    for (int shift = 0; ; shift += 7) {
+      if (p == end || shift >= 7 * kMaxVarintBytes32) return false;
+      const uint8_t b = *p++;
+      v |= (uint32_t)(b & 0x7f) << shift;
+      if (!(b & 0x80)) break;
+    }
+    prev += (uint32_t)UnZigZag32(v);
+    ins[i] = prev;
+  }
+  return p == end;
+}
+
+// Splits zigzag deltas of n addresses into ptr_bytes planes of n bytes each.
+inline void EncodeAddrColumn(void* const addrs[], uint32_t n,
+    uint32_t ptr_bytes, uint8_t* planes) {
+  const int unused_bits = 64 - 8 * ptr_bytes;
+  uint64_t prev = 0;
+  for (uint32_t i = 0; i < n; ++i) {
+    const uint64_t addr = (uintptr_t)addrs[i];
+    // Sign-extends the delta from the pointer width so it fits the planes.
+    uint64_t v = ZigZag64((int64_t)((addr - prev) << unused_bits) >>
+        unused_bits);
+    prev = addr;
+    for (uint32_t b = 0; b < ptr_bytes; ++b) {
+      planes[(size_t)b * n + i] = (uint8_t)v;
+      v >>= 8;
+    }
+  }
+}
+
+// Writes n addresses of ptr_bytes each, in the layout of the raw column.
+// Planes are given one by one, as they need not be adjacent when decoded.
+inline void DecodeAddrColumn(const uint8_t* const planes[], uint32_t n,
+    uint32_t ptr_bytes, char* addrs) {
+  uint64_t prev = 0;
+  for (uint32_t i = 0; i < n; ++i) {
+    uint64_t v = 0;
+    for (uint32_t b = 0; b < ptr_bytes; ++b) {
+      v |= (uint64_t)planes[b][i] << (8 * b);
+    }
+    prev += (uint64_t)UnZigZag64(v);
+    if (ptr_bytes < 8) prev &= ((uint64_t)1 << (8 * ptr_bytes)) - 1;
+    memcpy(addrs + (size_t)ptr_bytes * i, &prev, ptr_bytes);
+  }
+}
+
+#endif // SEXAIN_MEM_ADDR_FORMAT_H_
+
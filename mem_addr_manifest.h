@@ -0,0 +1,120 @@
+// mem_addr_manifest.h
+// Copyright (c) 2014 Jinglei Ren <jinglei.ren@stanzax.org>
+
+#ifndef SEXAIN_MEM_ADDR_MANIFEST_H_
+#define SEXAIN_MEM_ADDR_MANIFEST_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// A trace rolled over into segment files is described by a text manifest:
+//
+//   # MemAddrTrace manifest 1
+//   <segment file> <first ins_seq> <last ins_seq> <number of records>
+//   ...
+//
+// with one line per segment in order. Segment files are named relative to
+// the manifest, and each is a complete trace on its own.
+
+const char* const kManifestMagic = "# MemAddrTrace manifest 1";
+
+struct TraceSegment {
+  std::string file;
+  uint64_t first_ins;
+  uint64_t last_ins;
+  uint64_t num_records;
+
+  TraceSegment() : first_ins(UINT64_MAX), last_ins(0), num_records(0) { }
+};
+
+class TraceManifest {
+ public:
+  // Segment files are resolved to paths next to the manifest.
+  bool Load(const char* path);
+  // Replaces the manifest at once, so readers never see a partial one.
+  bool Save(const char* path) const;
+  static bool IsManifest(const char* path);
+  // The path a segment file is named after, e.g., file for file.0001.trace,
+  // or an empty string if the file is not named as a segment.
+  static std::string SegmentBase(const std::string& file);
+
+  std::vector<TraceSegment>& segments() { return segments_; }
+  const std::vector<TraceSegment>& segments() const { return segments_; }
+
+ private:
+  std::vector<TraceSegment> segments_;
+};
+
+inline bool TraceManifest::IsManifest(const char* path) {
+  FILE* file = fopen(path, "r");
+  if (!file) return false;
+  char line[64] = { 0 };
+  const bool is_manifest = fgets(line, sizeof(line), file) &&
+      strncmp(line, kManifestMagic, strlen(kManifestMagic)) == 0;
+  fclose(file);
+  return is_manifest;
+}
+
+inline std::string TraceManifest::SegmentBase(const std::string& file) {
+  const char* const suffix = ".trace";
+  const size_t n = strlen(".0000") + strlen(suffix);
+  if (file.size() <= n || file.compare(file.size() - strlen(suffix),
+      strlen(suffix), suffix) != 0 || file[file.size() - n] != '.' ||
+      file.find_first_not_of("0123456789", file.size() - n + 1) !=
+      file.size() - strlen(suffix)) {
+    return std::string();
+  }
+  return file.substr(0, file.size() - n);
+}
+
+inline bool TraceManifest::Load(const char* path) {
+  FILE* file = fopen(path, "r");
+  if (!file) return false;
+  const char* slash = strrchr(path, '/');
+  const std::string dir(path, slash ? slash + 1 - path : 0);
+
+  segments_.clear();
+  char line[4096];
+  bool ok = fgets(line, sizeof(line), file) &&
+      strncmp(line, kManifestMagic, strlen(kManifestMagic)) == 0;
+  while (ok && fgets(line, sizeof(line), file)) {
+    if (line[0] == '#' || line[0] == '\n') continue;
+    char name[sizeof(line)];
+    TraceSegment segment;
+    unsigned long long first, last, num;
+    if (sscanf(line, "%s %llu %llu %llu", name, &first, &last, &num) != 4) {
+      ok = false;
+      break;
+    }
+    segment.file = dir + name;
+    segment.first_ins = first;
+    segment.last_ins = last;
+    segment.num_records = num;
+    segments_.push_back(segment);
+  }
+  fclose(file);
+  return ok;
+}
+
+inline bool TraceManifest::Save(const char* path) const {
+  const std::string temp = std::string(path) + ".tmp";
+  FILE* file = fopen(temp.c_str(), "w");
+  if (!file) return false;
+  fprintf(file, "%s\n", kManifestMagic);
+  for (std::vector<TraceSegment>::const_iterator it = segments_.begin();
+      it != segments_.end(); ++it) {
+    const char* slash = strrchr(it->file.c_str(), '/');
+    fprintf(file, "%s %llu %llu %llu\n",
+        slash ? slash + 1 : it->file.c_str(),
+        (unsigned long long)it->first_ins, (unsigned long long)it->last_ins,
+        (unsigned long long)it->num_records);
+  }
+  const bool ok = !ferror(file);
+  return (fclose(file) == 0) && ok && rename(temp.c_str(), path) == 0;
+}
+
+#endif // SEXAIN_MEM_ADDR_MANIFEST_H_
+
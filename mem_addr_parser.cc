@@ -3,87 +3,1399 @@
 
 #include "mem_addr_parser.h"
 
-MemAddrParser::MemAddrParser(const char* file) {
-  file_ = fopen(file, "rb");
-  if (fread(&buffer_count_, sizeof(buffer_count_), 1, file_) != 1 ||
-      fread(&ptr_bytes_, sizeof(ptr_bytes_), 1, file_) != 1 ||
-      buffer_count() > 0x10000000 || (ptr_bytes_ & 0x60) != 0) {
-    fclose(file_);
-    file_ = NULL;
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <set>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// BlockReader
+
+BlockReader::BlockReader() : is_zlib_(false), map_(NULL), fd_(-1),
+    offset_(0), left_(0), next_(out_), end_(out_) {
+  memset(&zs_, 0, sizeof(zs_));
+  BUG_ON(inflateInit(&zs_) != Z_OK);
+}
+
+BlockReader::~BlockReader() {
+  inflateEnd(&zs_);
+}
+
+void BlockReader::Reset(const Bytef* map, FILE* file, uint64_t offset,
+    uint64_t len, bool is_zlib) {
+  is_zlib_ = is_zlib;
+  map_ = map;
+  fd_ = map ? -1 : fileno(file);
+  offset_ = offset;
+  left_ = len;
+  next_ = end_ = out_;
+  if (is_zlib) {
+    inflateReset(&zs_);
+    zs_.avail_in = 0;
+  }
+}
+
+bool BlockReader::GetVarint(uint64_t* v, int max_bytes) {
+  *v = 0;
+  for (int shift = 0; shift < 7 * max_bytes; shift += 7) {
+    const int b = Get();
+    if (b < 0) return false;
+    *v |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) return true;
+  }
+  return false;
+}
+
+// Makes the next window of bytes available. Input in the mapping is taken
+// as it is, and input from the file is read a window at a time.
+bool BlockReader::Fill() {
+  if (!is_zlib_) {
+    if (left_ == 0) return false;
+    if (map_) {
+      next_ = map_ + offset_;
+      end_ = next_ + left_;
+    } else {
+      const size_t n = std::min<uint64_t>(left_, sizeof(out_));
+      if (pread(fd_, out_, n, offset_) != (ssize_t)n) return false;
+      next_ = out_;
+      end_ = out_ + n;
+    }
+    offset_ += end_ - next_;
+    left_ -= end_ - next_;
+    return true;
+  }
+
+  zs_.next_out = out_;
+  zs_.avail_out = sizeof(out_);
+  while (zs_.avail_out == sizeof(out_)) {
+    if (zs_.avail_in == 0) {
+      if (left_ == 0) break;
+      size_t n = left_;
+      if (map_) {
+        zs_.next_in = (Bytef*)map_ + offset_;
+      } else {
+        n = std::min<uint64_t>(left_, sizeof(in_));
+        if (pread(fd_, in_, n, offset_) != (ssize_t)n) break;
+        zs_.next_in = in_;
+      }
+      zs_.avail_in = n;
+      offset_ += n;
+      left_ -= n;
+    }
+    const int ret = inflate(&zs_, Z_NO_FLUSH);
+    if (ret != Z_OK) break; // including the end of the block
+  }
+  next_ = out_;
+  end_ = zs_.next_out;
+  return next_ != end_;
+}
+
+// MemAddrStream
+
+MemAddrStream::MemAddrStream(const std::vector<std::string>& files,
+    uint32_t thread_id, RecordFilter filter, DecodePool* pool, int depth,
+    bool streaming, bool follow, uint64_t max_bytes) :
+    files_(files), next_file_(1), thread_id_(thread_id), filter_(filter),
+    pool_(pool), depth_(pool ? std::max(depth, 2) : 1), streaming_(false),
+    follow_(follow), complete_(true),
+    i_next_(0), i_limit_(0), ins_array_(NULL), addr_array_(NULL),
+    op_array_(NULL), current_(NULL) {
+  memset(&header_, 0, sizeof(header_));
+  file_ = NULL;
+  map_ = NULL;
+  index_loaded_ = false;
+  restricted_ = false;
+  if (files_.empty() || !OpenSegment(0)) {
     std::cerr << "[Error] MemAddrParser init failed." << std::endl;
     return;
   }
-  ins_array_ = new uint32_t[buffer_count()];
-  addr_array_ = new char[buffer_count() * ptr_bytes_ / sizeof(char)];
-  op_array_ = new char[buffer_count()];
-  ins_comp_ = (Bytef*)malloc(compressBound(sizeof(uint32_t) * buffer_count()));
-  addr_comp_ = (Bytef*)malloc(compressBound(ptr_bytes_ * buffer_count()));
-  op_comp_ = (Bytef*)malloc(compressBound(sizeof(char) * buffer_count()));
-  i_next_ = 0;
-  i_limit_ = buffer_count();
+  codec_ = BlockCodec((TraceCodec)header_.codec, header_.codec_level);
+  if (!codec_.is_available()) {
+    CloseSegment();
+    std::cerr << "[Error] MemAddrParser is not built with codec "
+        << codec_.name() << "." << std::endl;
+    return;
+  }
+  const uint32_t ptr_bytes = header_.ptr_bytes;
+  raw_bytes_ = std::max<size_t>(MaxInsColumnBytes(header_, buffer_count()),
+      (size_t)ptr_bytes * buffer_count());
+  const size_t ins_bound =
+      codec_.Bound(MaxInsColumnBytes(header_, buffer_count()));
+  if (version() < 2) {
+    raw_bytes_ = 0;
+    bounds_.push_back(codec_.Bound(sizeof(uint32_t) * buffer_count()));
+    bounds_.push_back(codec_.Bound(ptr_bytes * buffer_count()));
+    bounds_.push_back(codec_.Bound(sizeof(char) * buffer_count()));
+  } else if (version() < 3) {
+    bounds_.push_back(ins_bound);
+    bounds_.insert(bounds_.end(), ptr_bytes, codec_.Bound(buffer_count()));
+    bounds_.push_back(codec_.Bound(sizeof(char) * buffer_count()));
+  } else {
+    bounds_.push_back(codec_.Bound((buffer_count() + 7) / 8));
+    for (int i = 0; i < 2; ++i) {
+      bounds_.push_back(ins_bound);
+      bounds_.insert(bounds_.end(), ptr_bytes,
+          codec_.Bound(buffer_count()));
+    }
+  }
+  assert((int)bounds_.size() == NumChunkBlocks(header_));
+  if (streaming && !CanStream()) {
+    std::cerr << "[Warn] MemAddrParser cannot stream version " << version()
+        << " with " << codec_.name() << ", decoding whole chunks instead."
+        << std::endl;
+  }
+  streaming_ = streaming && CanStream();
+  if (streaming_) {
+    current_ = NewSlot(); // only for the blocks of the chunk
+    slots_.push_back(current_);
+    window_ins_.resize(kStreamWindow);
+    window_addrs_.resize(kStreamWindow);
+    window_ops_.resize(kStreamWindow);
+    ins_array_ = window_ins_.data();
+    addr_array_ = (char*)window_addrs_.data();
+    op_array_ = window_ops_.data();
+    for (int i = 0; i < (int)bounds_.size(); ++i) {
+      readers_.push_back(IsBlockNeeded(i) ? new BlockReader() : NULL);
+    }
+    chunk_left_ = 0;
+  } else {
+    if (pool_) {
+      depth_ = std::max<uint64_t>(2,
+          std::min<uint64_t>(depth_, max_bytes / SlotBytes()));
+    }
+    slots_.push_back(NewSlot()); // more as ReadAhead() needs them
+    free_.push_back(slots_.back());
+  }
 
   base_ins_ = 0;
-  base_step_ = (uint64_t)1 << (sizeof(ins_array_[0]) * 8);
+  base_step_ = (uint64_t)1 << 32;
   last_ins_ = 0;
 
   Replenish();
 }
 
-bool MemAddrParser::Replenish() {
-  if (!file_) return false;
-  uLong ins_len = 0, addr_len = 0, op_len = 0;
-  if (fread(&ins_len, sizeof(ins_len), 1, file_) != 1) {
-    assert(ftell(file_) == (fseek(file_, 0, SEEK_END), ftell(file_)));
-    Close();
+bool MemAddrStream::ReadHeader(FILE* file, TraceHeader* header) {
+  memset(header, 0, sizeof(TraceHeader));
+  uint32_t word;
+  if (fread(&word, sizeof(word), 1, file) != 1) return false;
+  if (word != kTraceMagic) { // legacy: buffer length and pointer width
+    header->buffer_length = word;
+    if (fread(&header->ptr_bytes, sizeof(header->ptr_bytes), 1, file) != 1) {
+      return false;
+    }
+  } else {
+    const size_t prefix = offsetof(TraceHeader, header_size) +
+        sizeof(header->header_size);
+    char* fields = (char*)header;
+    header->magic = word;
+    if (fread(fields + sizeof(word), prefix - sizeof(word), 1, file) != 1 ||
+        header->header_size < prefix) {
+      return false;
+    }
+    // Fields appended by newer writers are skipped, and those missing
+    // from older writers are left zero.
+    const size_t known =
+        std::min<size_t>(header->header_size, sizeof(TraceHeader));
+    if (known > prefix &&
+        fread(fields + prefix, known - prefix, 1, file) != 1) {
+      return false;
+    }
+    if (header->header_size > known &&
+        fseek(file, header->header_size - known, SEEK_CUR)) {
+      return false;
+    }
+    header->header_size = sizeof(TraceHeader);
+  }
+  return header->version <= kTraceVersion &&
+      header->buffer_length <= 0x10000000 && (header->ptr_bytes & 0x60) == 0;
+}
+
+bool MemAddrStream::ReadIndex(FILE* file, const TraceHeader& header,
+    uint64_t* data_end, std::vector<ChunkIndexEntry>* entries) {
+  const long pos = ftell(file);
+  IndexTrailer trailer;
+  bool found = false;
+  if (fseek(file, 0, SEEK_END) == 0) {
+    const uint64_t size = ftell(file);
+    *data_end = size;
+    found = header.version >= 5 && size >= sizeof(trailer) &&
+        fseek(file, -(long)sizeof(trailer), SEEK_END) == 0 &&
+        fread(&trailer, sizeof(trailer), 1, file) == 1 &&
+        trailer.magic == kIndexMagic &&
+        trailer.entry_size >= offsetof(ChunkIndexEntry, num_records) &&
+        trailer.index_offset <= size - sizeof(trailer) &&
+        trailer.num_entries * trailer.entry_size ==
+            size - sizeof(trailer) - trailer.index_offset;
+  }
+  if (found) *data_end = trailer.index_offset;
+  if (found && entries) {
+    // Fields appended by newer writers are skipped.
+    const size_t known =
+        std::min<size_t>(trailer.entry_size, sizeof(ChunkIndexEntry));
+    entries->resize(trailer.num_entries);
+    found = fseek(file, trailer.index_offset, SEEK_SET) == 0;
+    for (uint64_t i = 0; found && i < trailer.num_entries; ++i) {
+      ChunkIndexEntry& entry = (*entries)[i];
+      memset(&entry, 0, sizeof(entry));
+      found = fread(&entry, known, 1, file) == 1 &&
+          fseek(file, trailer.entry_size - known, SEEK_CUR) == 0;
+      if (known < sizeof(ChunkIndexEntry)) { // without bounds
+        entry.num_writes = entry.num_records;
+        entry.min_addr = 0;
+        entry.max_addr = UINT64_MAX;
+      }
+    }
+  }
+  fseek(file, pos, SEEK_SET);
+  return found;
+}
+
+bool MemAddrStream::SkipBlocks(FILE* file, int num_blocks) {
+  uint64_t len;
+  for (int i = 0; i < num_blocks; ++i) {
+    if (fread(&len, sizeof(len), 1, file) != 1 ||
+        fseek(file, len, SEEK_CUR)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool MemAddrStream::SkipChunk(FILE* file, const TraceHeader& header,
+    ChunkHeader* chunk) {
+  memset(chunk, 0, sizeof(ChunkHeader));
+  return fread(chunk, ChunkHeaderSize(header), 1, file) == 1 &&
+      SkipBlocks(file, NumChunkBlocks(header));
+}
+
+// Moves on to the next decoded chunk, skipping those that yield no
+// records, such as those without writes.
+bool MemAddrStream::Replenish() {
+  i_next_ = i_limit_ = 0;
+  while (i_limit_ == 0) {
+    if (streaming_) {
+      if (chunk_left_ == 0 && !BeginChunk()) return false;
+      i_limit_ = StreamWindow();
+    } else {
+      if (current_) free_.push_back(current_);
+      current_ = NULL;
+      ReadAhead();
+      if (ahead_.empty()) return false;
+      current_ = ahead_.front();
+      ahead_.pop_front();
+      if (pool_) pool_->Wait(current_);
+
+      ins_array_ = current_->ins_array;
+      addr_array_ = current_->addr_array;
+      op_array_ = current_->op_array;
+      i_limit_ = current_->size;
+    }
+    if (version() < 6) ExtendIns(i_limit_);
+    if (version() < 3 && filter_ == kWritesOnly) {
+      i_limit_ = CompactWrites(i_limit_);
+    }
+    if (header_.ptr_bytes < sizeof(uint64_t)) WidenAddrs(i_limit_);
+  }
+  return true;
+}
+
+// Reads following chunks into free slots, up to depth_ slots in all, and
+// decodes them by the pool or right away.
+void MemAddrStream::ReadAhead() {
+  while (file_) {
+    if (free_.empty()) {
+      if ((int)slots_.size() >= depth_) break;
+      slots_.push_back(NewSlot());
+      free_.push_back(slots_.back());
+    }
+    if (!ReadChunk(free_.back())) break;
+    Slot* slot = free_.back();
+    free_.pop_back();
+    ahead_.push_back(slot);
+    if (pool_) {
+      pool_->Submit(this, slot);
+    } else {
+      Decode(slot);
+    }
+  }
+}
+
+// Waits until no chunk is being decoded, so that the segment they are read
+// from can be left and the layout they are decoded by can change.
+void MemAddrStream::Drain() {
+  if (!pool_) return;
+  for (std::deque<Slot*>::iterator it = ahead_.begin();
+      it != ahead_.end(); ++it) {
+    pool_->Wait(*it);
+  }
+}
+
+bool MemAddrStream::CanStream() const {
+  return version() >= 2 &&
+      (codec_.id() == kCodecZlib || codec_.id() == kCodecNone);
+}
+
+// Reads the next chunk of this thread and starts to stream its blocks.
+bool MemAddrStream::BeginChunk() {
+  if (!file_ || !ReadChunk(current_)) return false;
+  const ChunkHeader& chunk = current_->chunk;
+  for (unsigned int i = 0; i < readers_.size(); ++i) {
+    if (!readers_[i]) continue;
+    readers_[i]->Reset((const Bytef*)map_, file_, current_->offsets[i],
+        current_->lens[i], codec_.id() == kCodecZlib);
+  }
+  const uint32_t n = chunk.num_records;
+  BUG_ON(n > buffer_count() || chunk.num_writes > n);
+  if (version() < 3) {
+    BeginCursor(&cursors_[0], 0, n);
+    chunk_left_ = n;
+  } else {
+    BeginCursor(&cursors_[0], StreamBlock(header_, true), chunk.num_writes);
+    BeginCursor(&cursors_[1], StreamBlock(header_, false),
+        n - chunk.num_writes);
+    chunk_left_ = filter_ == kWritesOnly ? chunk.num_writes : n;
+  }
+  return true;
+}
+
+void MemAddrStream::BeginCursor(StreamCursor* cursor, int block, uint32_t n) {
+  cursor->block = block;
+  cursor->left = n;
+  cursor->ins = version() < 6 ? 0 : current_->chunk.base_ins;
+  cursor->addr = 0;
+}
+
+// Decodes the following records of the current chunk into the window,
+// in the same way as whole chunks are decoded.
+uint32_t MemAddrStream::StreamWindow() {
+  const uint32_t n = std::min(kStreamWindow, chunk_left_);
+  const uint32_t first = current_->chunk.num_records - chunk_left_;
+  for (uint32_t i = 0; i < n; ++i) {
+    if (version() < 3) {
+      StreamRecord(&cursors_[0], i);
+      const int op = readers_.back()->Get();
+      BUG_ON(op != 'R' && op != 'W');
+      op_array_[i] = op;
+    } else if (filter_ == kWritesOnly) {
+      StreamRecord(&cursors_[0], i);
+      op_array_[i] = 'W';
+    } else {
+      if ((first + i) % 8 == 0) {
+        const int bits = readers_[0]->Get();
+        BUG_ON(bits < 0);
+        bits_ = bits;
+      }
+      const bool is_write = bits_ & 1;
+      bits_ >>= 1;
+      StreamRecord(&cursors_[is_write ? 0 : 1], i);
+      op_array_[i] = is_write ? 'W' : 'R';
+    }
+  }
+  chunk_left_ -= n;
+  return n;
+}
+
+// Decodes the next record of the stream into the i-th place of the window.
+void MemAddrStream::StreamRecord(StreamCursor* cursor, uint32_t i) {
+  BUG_ON(cursor->left == 0);
+  --cursor->left;
+  uint64_t v;
+  if (version() < 6) {
+    BUG_ON(!readers_[cursor->block]->GetVarint(&v, kMaxVarintBytes32));
+    cursor->ins = (uint32_t)(cursor->ins + UnZigZag32((uint32_t)v));
+  } else {
+    BUG_ON(!readers_[cursor->block]->GetVarint(&v, kMaxVarintBytes64));
+    cursor->ins += (uint64_t)UnZigZag64(v);
+  }
+  ins_array_[i] = cursor->ins;
+
+  const uint32_t ptr_bytes = header_.ptr_bytes;
+  v = 0;
+  for (uint32_t b = 0; b < ptr_bytes; ++b) {
+    const int byte = readers_[cursor->block + 1 + b]->Get();
+    BUG_ON(byte < 0);
+    v |= (uint64_t)byte << (8 * b);
+  }
+  cursor->addr += (uint64_t)UnZigZag64(v);
+  if (ptr_bytes < 8) cursor->addr &= ((uint64_t)1 << (8 * ptr_bytes)) - 1;
+  memcpy(addr_array_ + (size_t)ptr_bytes * i, &cursor->addr, ptr_bytes);
+}
+
+// Reads the next chunk of this thread, leaving out blocks not needed.
+// A live segment is left at the first chunk not fully written yet.
+bool MemAddrStream::ReadChunk(Slot* slot) {
+  while (true) {
+    if (Tell() < data_end_) {
+      const uint64_t pos = Tell();
+      if (LoadChunk(slot)) {
+        if (IsWanted(slot->chunk, pos)) return true;
+        continue;
+      }
+      if (is_live()) {
+        SetPos(pos);
+        return false;
+      }
+      std::cerr << "[Warn] MemAddrParser found a truncated chunk in "
+          << files_[next_file_ - 1] << std::endl;
+    }
+    if (is_live()) return false;
+    Drain();
+    if (!OpenNextSegment()) return false;
+  }
+}
+
+// Reads the chunk at the current position, or only its header if it
+// belongs to another thread or is skipped. Returns false if the file ends
+// early, or if what is there cannot be a chunk, e.g., an index being written.
+bool MemAddrStream::LoadChunk(Slot* slot) {
+  ChunkHeader* chunk = &slot->chunk;
+  memset(chunk, 0, sizeof(ChunkHeader));
+  const uint64_t pos = Tell();
+  if (version() > 0 && (!ReadBytes(chunk, ChunkHeaderSize(header_)) ||
+      chunk->num_records > buffer_count() ||
+      chunk->num_writes > chunk->num_records)) {
     return false;
   }
-  BUG_ON(fread(ins_comp_, 1, ins_len, file_) != ins_len);
+  const bool is_own = IsWanted(*chunk, pos);
+  for (unsigned int i = 0; i < bounds_.size(); ++i) {
+    if (!ReadBytes(&slot->lens[i], sizeof(slot->lens[i])) ||
+        slot->lens[i] > bounds_[i]) {
+      return false;
+    }
+    if (is_own && IsBlockNeeded(i)) {
+      if (!LoadBlock(slot, i)) return false;
+    } else if (!SkipBytes(slot->lens[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+uint64_t MemAddrStream::Tell() const {
+  return map_ ? pos_ : (uint64_t)ftell(file_);
+}
+
+bool MemAddrStream::SetPos(uint64_t pos) {
+  if (!map_) return fseek(file_, pos, SEEK_SET) == 0;
+  if (pos > map_size_) return false;
+  pos_ = pos;
+  return true;
+}
+
+bool MemAddrStream::ReadBytes(void* dst, size_t bytes) {
+  if (!map_) return fread(dst, 1, bytes, file_) == bytes;
+  if (map_size_ - pos_ < bytes) return false;
+  memcpy(dst, map_ + pos_, bytes);
+  pos_ += bytes;
+  return true;
+}
+
+bool MemAddrStream::SkipBytes(uint64_t bytes) {
+  if (!map_) return fseek(file_, bytes, SEEK_CUR) == 0;
+  if (map_size_ - pos_ < bytes) return false;
+  pos_ += bytes;
+  return true;
+}
+
+// Points the block to its bytes in the mapping, or reads them into a buffer.
+// When streaming, only notes where the block is.
+bool MemAddrStream::LoadBlock(Slot* slot, int block) {
+  const uint64_t len = slot->lens[block];
+  if (streaming_) {
+    slot->offsets[block] = Tell();
+    return SkipBytes(len);
+  }
+  if (map_) {
+    if (map_size_ - pos_ < len) return false;
+    slot->blocks[block] = (const Bytef*)map_ + pos_;
+    pos_ += len;
+    return true;
+  }
+  Bytef*& comp = slot->comps[block];
+  if (!comp) comp = (Bytef*)malloc(bounds_[block]);
+  slot->blocks[block] = comp;
+  return fread(comp, 1, len, file_) == len;
+}
+
+// Returns the decompressed bytes of the block, which are the block itself
+// if it is not compressed. On input, *len is the capacity of dst.
+const uint8_t* MemAddrStream::Inflate(const Slot& slot, int block,
+    uint8_t* dst, size_t* len) const {
+  if (codec_.id() == kCodecNone) {
+    BUG_ON(slot.lens[block] > *len);
+    *len = slot.lens[block];
+    return slot.blocks[block];
+  }
+  BUG_ON(!codec_.Decompress(dst, len, slot.blocks[block], slot.lens[block]));
+  return dst;
+}
+
+// Opens the i-th segment, which has to be laid out like the ones before.
+bool MemAddrStream::OpenSegment(size_t i) {
+  CloseSegment();
+  const TraceHeader prev = header_;
+  file_ = fopen(files_[i].c_str(), "rb");
+  if (file_ && ReadHeader(file_, &header_) && (slots_.empty() ||
+      (header_.version == prev.version &&
+      header_.buffer_length == prev.buffer_length &&
+      header_.ptr_bytes == prev.ptr_bytes && header_.codec == prev.codec))) {
+    // Traces before version 5 have no index to tell that they are complete.
+    complete_ = ReadIndex(file_, header_, &data_end_, NULL) ||
+        header_.version < 5;
+    MapSegment();
+    next_file_ = i + 1;
+    return true;
+  }
+  std::cerr << "[Error] MemAddrParser failed to open " << files_[i]
+      << std::endl;
+  CloseSegment();
+  header_ = prev;
+  return false;
+}
+
+// Maps the opened segment to decompress chunks in place. Concurrent readers
+// of a trace share its pages. Without mapping, chunks are read by fread.
+void MemAddrStream::MapSegment() {
+  struct stat st;
+  if (fstat(fileno(file_), &st) || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    return;
+  }
+  void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(file_), 0);
+  if (map == MAP_FAILED) return;
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  map_ = (const char*)map;
+  map_size_ = st.st_size;
+  pos_ = ftell(file_);
+}
+
+// Takes in chunks appended to a live segment, and whether it is complete.
+void MemAddrStream::Refresh() {
+  if (!is_live()) return;
+  Drain();
+  clearerr(file_);
+  complete_ = ReadIndex(file_, header_, &data_end_, NULL);
+  if (map_ && data_end_ > map_size_) { // maps the new size
+    const uint64_t pos = pos_;
+    munmap((void*)map_, map_size_);
+    map_ = NULL;
+    MapSegment();
+    if (map_) pos_ = pos;
+    else fseek(file_, pos, SEEK_SET);
+  }
+}
+
+void MemAddrStream::CloseSegment() {
+  if (map_) munmap((void*)map_, map_size_);
+  map_ = NULL;
+  if (file_) fclose(file_);
+  file_ = NULL;
+}
+
+// Continues with the next segment at the end of the current one.
+// After the last segment, the file is closed but buffers are kept for Seek.
+bool MemAddrStream::OpenNextSegment() {
+  if (next_file_ < files_.size() && OpenSegment(next_file_)) return true;
+  CloseSegment();
+  return false;
+}
+
+// Collects the index entries of this thread from all segments.
+bool MemAddrStream::LoadIndex() {
+  if (index_loaded_) return !index_.empty();
+  index_loaded_ = true;
+  std::vector<ChunkIndexEntry> entries;
+  for (size_t i = 0; i < files_.size(); ++i) {
+    FILE* file = fopen(files_[i].c_str(), "rb");
+    TraceHeader header;
+    uint64_t data_end;
+    const bool found = file && ReadHeader(file, &header) &&
+        ReadIndex(file, header, &data_end, &entries);
+    if (file) fclose(file);
+    if (!found) {
+      index_.clear();
+      return false;
+    }
+    for (std::vector<ChunkIndexEntry>::iterator it = entries.begin();
+        it != entries.end(); ++it) {
+      if (it->thread_id != thread_id_) continue;
+      IndexedChunk chunk = { i, *it, false };
+      index_.push_back(chunk);
+    }
+  }
+  if (version() < 6) ExtendIndex();
+  return !index_.empty();
+}
+
+// Restores the high bits of entries before version 6 in the same way as
+// ExtendIns() does for records, so that a stream can start at any entry.
+void MemAddrStream::ExtendIndex() {
+  uint64_t base_ins = 0, last_ins = 0;
+  for (std::vector<IndexedChunk>::iterator it = index_.begin();
+      it != index_.end(); ++it) {
+    uint64_t* bounds[] = { &it->entry.first_ins, &it->entry.last_ins };
+    for (int i = 0; i < 2; ++i) {
+      uint64_t ins_seq = (uint32_t)*bounds[i] + base_ins;
+      if (ins_seq < last_ins) {
+        ins_seq += base_step_;
+        base_ins += base_step_;
+      }
+      *bounds[i] = last_ins = ins_seq;
+    }
+  }
+}
+
+bool MemAddrStream::Seek(uint64_t ins_seq) {
+  if (slots_.empty()) return false;
+  if (streaming_) {
+    chunk_left_ = 0;
+  } else {
+    Drain();
+    if (current_) free_.push_back(current_);
+    current_ = NULL;
+    free_.insert(free_.end(), ahead_.begin(), ahead_.end());
+    ahead_.clear();
+  }
+  uint64_t first_ins = 0;
+  if (!LoadIndex()) { // scans from the beginning
+    if (!OpenSegment(0)) return false;
+  } else {
+    // Chunks of a thread are in order, so are their last ins_seq.
+    std::vector<IndexedChunk>::iterator it = std::lower_bound(
+        index_.begin(), index_.end(), ins_seq, IndexedChunk::EndsBefore);
+    if (it == index_.end() || !OpenSegment(it->segment) ||
+        !SetPos(it->entry.offset)) {
+      CloseSegment();
+      return false;
+    }
+    first_ins = it->entry.first_ins;
+  }
+  i_next_ = i_limit_ = 0;
+  // Records before version 6 are extended on from the high bits of the
+  // chunk, which are 0 for the first one.
+  base_ins_ = first_ins & ~(base_step_ - 1);
+  last_ins_ = first_ins;
+
+  MemRecord rec;
+  while (Next(&rec)) {
+    if (rec.ins_seq >= ins_seq) {
+      --i_next_; // to be returned again
+      return true;
+    }
+  }
+  return false;
+}
+
+void MemAddrStream::Restrict(const RecordRange& range) {
+  restricted_ = LoadIndex();
+  for (std::vector<IndexedChunk>::iterator it = index_.begin();
+      it != index_.end(); ++it) {
+    const ChunkIndexEntry& entry = it->entry;
+    it->skipped = !range.Overlaps(entry) ||
+        (filter_ == kWritesOnly && entry.num_writes == 0);
+  }
+}
+
+// Whether the chunk at the offset of the current segment has to be loaded
+bool MemAddrStream::IsWanted(const ChunkHeader& chunk,
+    uint64_t offset) const {
+  if (version() > 0 && chunk.thread_id != thread_id_) return false;
+  if (!restricted_) return true;
+  IndexedChunk key;
+  key.segment = next_file_ - 1;
+  key.entry.offset = offset;
+  std::vector<IndexedChunk>::const_iterator it = std::lower_bound(
+      index_.begin(), index_.end(), key, IndexedChunk::Precedes);
+  return it == index_.end() || it->segment != key.segment ||
+      it->entry.offset != offset || !it->skipped;
+}
+
+bool MemAddrStream::IsBlockNeeded(int block) const {
+  if (version() < 3 || filter_ == kAllRecords) return true;
+  return block >= StreamBlock(header_, true) &&
+      block < StreamBlock(header_, false);
+}
+
+MemAddrStream::Slot* MemAddrStream::NewSlot() const {
+  const uint32_t n = buffer_count();
+  const uint32_t ptr_bytes = header_.ptr_bytes;
+  Slot* slot = new Slot;
+  slot->blocks.resize(bounds_.size());
+  slot->comps.resize(bounds_.size());
+  slot->lens.resize(bounds_.size());
+  slot->offsets.resize(bounds_.size());
+  slot->size = 0;
+  slot->busy = false;
+  if (streaming_) {
+    slot->ins_array = NULL;
+    slot->addr_array = NULL;
+    slot->op_array = NULL;
+    slot->raw = NULL;
+    slot->part_ins = NULL;
+    slot->part_addr = NULL;
+    slot->bitmap = NULL;
+    return slot;
+  }
+  slot->ins_array = new uint64_t[n];
+  slot->addr_array = new char[n *
+      std::max<size_t>(ptr_bytes, sizeof(uint64_t)) / sizeof(char)];
+  slot->op_array = new char[n];
+  slot->raw = new Bytef[raw_bytes_];
+  slot->part_ins = NULL;
+  slot->part_addr = NULL;
+  slot->bitmap = NULL;
+  if (version() >= 3 && filter_ == kAllRecords) {
+    slot->part_ins = new uint64_t[n];
+    slot->part_addr = new char[n * ptr_bytes / sizeof(char)];
+    slot->bitmap = new uint8_t[(n + 7) / 8];
+  }
+  return slot;
+}
+
+// Bytes allocated by NewSlot() and for compressed blocks read without
+// mapping, at most.
+uint64_t MemAddrStream::SlotBytes() const {
+  const uint64_t n = buffer_count();
+  const uint32_t ptr_bytes = header_.ptr_bytes;
+  uint64_t bytes = n * (sizeof(uint64_t) +
+      std::max<size_t>(ptr_bytes, sizeof(uint64_t)) + sizeof(char)) +
+      raw_bytes_;
+  if (version() >= 3 && filter_ == kAllRecords) {
+    bytes += n * (sizeof(uint64_t) + ptr_bytes) + (n + 7) / 8;
+  }
+  if (!map_) {
+    for (int i = 0; i < (int)bounds_.size(); ++i) {
+      if (IsBlockNeeded(i)) bytes += bounds_[i];
+    }
+  }
+  return std::max<uint64_t>(bytes, 1);
+}
+
+void MemAddrStream::DeleteSlot(Slot* slot) {
+  for (std::vector<Bytef*>::iterator it = slot->comps.begin();
+      it != slot->comps.end(); ++it) {
+    free(*it);
+  }
+  delete[] slot->ins_array;
+  delete[] slot->addr_array;
+  delete[] slot->op_array;
+  delete[] slot->raw;
+  delete[] slot->part_ins;
+  delete[] slot->part_addr;
+  delete[] slot->bitmap;
+  delete slot;
+}
 
-  BUG_ON(fread(&addr_len, sizeof(addr_len), 1, file_) != 1);
-  BUG_ON(fread(addr_comp_, 1, addr_len, file_) != addr_len);
+void MemAddrStream::Close() {
+  Drain();
+  CloseSegment();
+  for (std::vector<Slot*>::iterator it = slots_.begin();
+      it != slots_.end(); ++it) {
+    DeleteSlot(*it);
+  }
+  slots_.clear();
+  for (std::vector<BlockReader*>::iterator it = readers_.begin();
+      it != readers_.end(); ++it) {
+    delete *it;
+  }
+  readers_.clear();
+  free_.clear();
+  ahead_.clear();
+  current_ = NULL;
+  ins_array_ = NULL;
+  addr_array_ = NULL;
+  op_array_ = NULL;
+}
 
-  BUG_ON(fread(&op_len, sizeof(op_len), 1, file_) != 1);
-  BUG_ON(fread(op_comp_, 1, op_len, file_) != op_len);
+// Decodes the columns of a chunk. Only the slot is written, so chunks of a
+// stream can be decoded in parallel, as long as the segment is not left.
+void MemAddrStream::Decode(Slot* slot) const {
+  if (version() < 2) {
+    slot->size = DecodeRaw(slot);
+    BUG_ON(version() > 0 && slot->size != slot->chunk.num_records);
+  } else if (version() < 3) {
+    slot->size = DecodeTransformed(slot);
+  } else {
+    slot->size = DecodeSplit(slot);
+  }
+}
 
-  uLong len;
+// Versions 0 and 1 store the columns as they are in memory.
+uint32_t MemAddrStream::DecodeRaw(Slot* slot) const {
+  size_t len;
   len = buffer_count() * sizeof(uint32_t);
-  BUG_ON(uncompress((Bytef*)ins_array_, &len, ins_comp_, ins_len) != Z_OK);
+  uint64_t* ins_array = slot->ins_array;
+  uint32_t* ins32 = (uint32_t*)ins_array;
+  BUG_ON(!codec_.Decompress(ins32, &len, slot->blocks[0], slot->lens[0]));
+  // Widens in place from the back, where no 32-bit value is overwritten
+  // before being read.
+  for (size_t i = len / sizeof(uint32_t); i > 0; --i) {
+    ins_array[i - 1] = ins32[i - 1];
+  }
 
-  len = buffer_count() * ptr_bytes_;
-  BUG_ON(uncompress((Bytef*)addr_array_, &len, addr_comp_, addr_len) != Z_OK);
+  len = buffer_count() * header_.ptr_bytes;
+  BUG_ON(!codec_.Decompress(slot->addr_array, &len,
+      slot->blocks[1], slot->lens[1]));
 
   len = buffer_count() * sizeof(char);
-  BUG_ON(uncompress((Bytef*)op_array_, &len, op_comp_, op_len) != Z_OK);
+  BUG_ON(!codec_.Decompress(slot->op_array, &len,
+      slot->blocks[2], slot->lens[2]));
+  for (size_t i = 0; i < len; ++i) {
+    BUG_ON(slot->op_array[i] != 'R' && slot->op_array[i] != 'W');
+  }
+  return len / sizeof(char);
+}
 
-  i_next_ = 0;
-  if (len / sizeof(char) != i_limit_) {
-    i_limit_ = len / sizeof(char);
+uint32_t MemAddrStream::DecodeTransformed(Slot* slot) const {
+  const uint32_t n = slot->chunk.num_records;
+  BUG_ON(n > buffer_count());
+  DecodeStream(*slot, 0, n, slot->chunk.base_ins,
+      slot->ins_array, slot->addr_array);
+
+  size_t len = n * sizeof(char);
+  BUG_ON(!codec_.Decompress(slot->op_array, &len, slot->blocks.back(),
+      slot->lens.back()) || len != n);
+  for (uint32_t i = 0; i < n; ++i) {
+    BUG_ON(slot->op_array[i] != 'R' && slot->op_array[i] != 'W');
   }
-  return true;
+  return n;
 }
 
-bool MemAddrParser::Next(MemRecord* rec) {
-  if (!file_ || (i_next_ == i_limit_ && !Replenish())) {
-    return false;
+// Version 3 restores the original order of the write and read streams
+// from the op bitmap, unless only writes are wanted.
+uint32_t MemAddrStream::DecodeSplit(Slot* slot) const {
+  const ChunkHeader& chunk = slot->chunk;
+  const uint32_t n = chunk.num_records;
+  const uint32_t num_writes = chunk.num_writes;
+  BUG_ON(n > buffer_count() || num_writes > n);
+  if (filter_ == kWritesOnly) {
+    DecodeStream(*slot, StreamBlock(header_, true), num_writes,
+        chunk.base_ins, slot->ins_array, slot->addr_array);
+    memset(slot->op_array, 'W', num_writes);
+    return num_writes;
   }
 
-  rec->ins_seq = ins_array_[i_next_] + base_ins_;
-  if (rec->ins_seq < last_ins_) {
-    assert(last_ins_ - rec->ins_seq > (base_step_ >> 3));
-    rec->ins_seq += base_step_;
-    base_ins_ += base_step_;
+  const uint32_t ptr_bytes = header_.ptr_bytes;
+  uint64_t* part_ins = slot->part_ins;
+  char* part_addr = slot->part_addr;
+  size_t len = (n + 7) / 8;
+  const uint8_t* bitmap = Inflate(*slot, 0, slot->bitmap, &len);
+  BUG_ON(len != (n + 7) / 8);
+  DecodeStream(*slot, StreamBlock(header_, true), num_writes,
+      chunk.base_ins, part_ins, part_addr);
+  DecodeStream(*slot, StreamBlock(header_, false), n - num_writes,
+      chunk.base_ins, part_ins + num_writes,
+      part_addr + (size_t)ptr_bytes * num_writes);
+
+  uint32_t wi = 0, ri = num_writes;
+  for (uint32_t i = 0; i < n; ++i) {
+    uint32_t j;
+    if (bitmap[i >> 3] & (1 << (i & 7))) {
+      slot->op_array[i] = 'W';
+      j = wi++;
+    } else {
+      slot->op_array[i] = 'R';
+      j = ri++;
+    }
+    slot->ins_array[i] = part_ins[j];
+    memcpy(slot->addr_array + (size_t)ptr_bytes * i,
+        part_addr + (size_t)ptr_bytes * j, ptr_bytes);
+  }
+  BUG_ON(wi != num_writes);
+  return n;
+}
+
+// Decodes an ins block and the addr planes following it.
+void MemAddrStream::DecodeStream(const Slot& slot, int block, uint32_t n,
+    uint64_t base_ins, uint64_t* ins, char* addrs) const {
+  if (n == 0) return;
+  const uint32_t ptr_bytes = header_.ptr_bytes;
+  size_t len = raw_bytes_;
+  const uint8_t* column = Inflate(slot, block, slot.raw, &len);
+  if (version() < 6) {
+    BUG_ON(!DecodeInsColumn32(column, len, ins, n));
+  } else {
+    BUG_ON(!DecodeInsColumn(column, len, base_ins, ins, n));
+  }
+
+  const uint8_t* planes[sizeof(uint64_t)];
+  for (uint32_t b = 0; b < ptr_bytes; ++b) {
+    len = n;
+    planes[b] = Inflate(slot, block + 1 + b, slot.raw + (size_t)b * n, &len);
+    BUG_ON(len != n);
+  }
+  DecodeAddrColumn(planes, n, ptr_bytes, addrs);
+}
+
+// Restores the high bits dropped by versions before 6, assuming that
+// instruction sequences never go backwards.
+void MemAddrStream::ExtendIns(uint32_t n) {
+  for (uint32_t i = 0; i < n; ++i) {
+    uint64_t ins_seq = ins_array_[i] + base_ins_;
+    if (ins_seq < last_ins_) {
+      assert(last_ins_ - ins_seq > (base_step_ >> 3));
+      ins_seq += base_step_;
+      base_ins_ += base_step_;
+    }
+    ins_array_[i] = last_ins_ = ins_seq;
+  }
+}
+
+// Zero-extends addresses of a trace from 32-bit programs in place, from the
+// back as in DecodeRaw().
+void MemAddrStream::WidenAddrs(uint32_t n) {
+  const uint32_t ptr_bytes = header_.ptr_bytes;
+  uint64_t* addrs = (uint64_t*)addr_array_;
+  for (uint32_t i = n; i > 0; --i) {
+    uint64_t addr = 0;
+    memcpy(&addr, addr_array_ + (size_t)ptr_bytes * (i - 1), ptr_bytes);
+    addrs[i - 1] = addr;
   }
-  last_ins_ = rec->ins_seq;
- 
-  rec->mem_addr = *((uint64_t*)
-      (addr_array_ + ptr_bytes_ * i_next_ / sizeof(char)));
+}
+
+// Drops reads from the decoded columns of an older trace.
+uint32_t MemAddrStream::CompactWrites(uint32_t n) {
+  const uint32_t ptr_bytes = header_.ptr_bytes;
+  uint32_t j = 0;
+  for (uint32_t i = 0; i < n; ++i) {
+    if (op_array_[i] != 'W') continue;
+    ins_array_[j] = ins_array_[i];
+    memmove(addr_array_ + (size_t)ptr_bytes * j,
+        addr_array_ + (size_t)ptr_bytes * i, ptr_bytes);
+    op_array_[j] = 'W';
+    ++j;
+  }
+  return j;
+}
+
+bool MemAddrStream::Next(MemRecord* rec) {
+  if (i_next_ == i_limit_ && !Replenish()) return false;
+
+  rec->ins_seq = ins_array_[i_next_];
+  rec->mem_addr = ((uint64_t*)addr_array_)[i_next_];
   rec->op = op_array_[i_next_];
-  BUG_ON(rec->op != 'R' && rec->op != 'W');
+  return ++i_next_;
+}
+
+bool MemAddrStream::NextBatch(uint64_t ins_limit, RecordBatch* batch) {
+  if (i_next_ == i_limit_ && !Replenish()) return false;
+  const uint64_t* begin = ins_array_ + i_next_;
+  const uint64_t* end = ins_array_ + i_limit_;
+  const uint32_t n = std::lower_bound(begin, end, ins_limit) - begin;
+  batch->ins_seqs = begin;
+  batch->mem_addrs = (uint64_t*)addr_array_ + i_next_;
+  batch->ops = op_array_ + i_next_;
+  batch->size = n;
+  batch->thread_id = thread_id_;
+  i_next_ += n;
+  return n;
+}
+
+// DecodePool
+
+DecodePool::DecodePool(int num_threads) : stopping_(false) {
+  for (int i = 0; i < num_threads; ++i) {
+    threads_.push_back(std::thread(&DecodePool::Run, this));
+  }
+}
+
+DecodePool::~DecodePool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  work_cond_.notify_all();
+  for (std::vector<std::thread>::iterator it = threads_.begin();
+      it != threads_.end(); ++it) {
+    it->join();
+  }
+}
+
+void DecodePool::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    while (queue_.empty() && !stopping_) work_cond_.wait(lock);
+    if (queue_.empty()) return;
+    const Job job = queue_.front();
+    queue_.pop_front();
+    lock.unlock();
+    job.stream->Decode(job.slot);
+    lock.lock();
+    job.slot->busy = false;
+    done_cond_.notify_all();
+  }
+}
+
+void DecodePool::Submit(const MemAddrStream* stream,
+    MemAddrStream::Slot* slot) {
+  const Job job = { stream, slot };
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    slot->busy = true;
+    queue_.push_back(job);
+  }
+  work_cond_.notify_one();
+}
+
+void DecodePool::Wait(const MemAddrStream::Slot* slot) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (slot->busy) done_cond_.wait(lock);
+}
+
+// MemAddrParser
+
+MemAddrParser::MemAddrParser(const char* file, RecordFilter filter,
+    int decoders, bool follow) : filter_(filter), decoders_(decoders),
+    follow_(follow), buffer_count_(0), filter_line_(0), filter_entries_(0),
+    pending_(-1), last_ins_(0), num_late_(0),
+    idle_limit_ms_(kFollowIdleMs), truncated_(false), pool_(NULL) {
+  std::vector<std::string> files;
+  if (!ListSegments(file, &files)) {
+    std::cerr << "[Error] MemAddrParser init failed." << std::endl;
+    return;
+  }
+  Init(files, filter, decoders);
+}
+
+MemAddrParser::MemAddrParser(const std::vector<std::string>& files,
+    RecordFilter filter, int decoders) : filter_(filter),
+    decoders_(decoders), follow_(false), buffer_count_(0), filter_line_(0),
+    filter_entries_(0), pending_(-1), last_ins_(0), num_late_(0),
+    idle_limit_ms_(kFollowIdleMs), truncated_(false), pool_(NULL) {
+  Init(files, filter, decoders);
+}
+
+MemAddrParser::MemAddrParser(const char* file, uint32_t thread_id,
+    RecordFilter filter, int decoders) : filter_(filter),
+    decoders_(decoders), follow_(false), buffer_count_(0), filter_line_(0),
+    filter_entries_(0), pending_(-1), thread_ids_(1, thread_id),
+    last_ins_(0), num_late_(0),
+    idle_limit_ms_(kFollowIdleMs), truncated_(false), pool_(NULL) {
+  greater_.heads = &heads_;
+  std::vector<std::string> files;
+  if (!ListSegments(file, &files)) {
+    std::cerr << "[Error] MemAddrParser init failed." << std::endl;
+    return;
+  }
+  if (decoders > 0) pool_ = new DecodePool(decoders);
+  AddStream(new MemAddrStream(files, thread_id, filter, pool_,
+      DecodeDepth(), decoders == kStreaming, false, DecodeBytes()));
+}
+
+void MemAddrParser::Init(const std::vector<std::string>& files,
+    RecordFilter filter, int decoders) {
+  greater_.heads = &heads_;
+  files_ = files;
+  if (!ScanThreads(files, &thread_ids_)) {
+    std::cerr << "[Error] MemAddrParser init failed." << std::endl;
+    return;
+  }
+  if (decoders > 0) pool_ = new DecodePool(decoders);
+  for (std::vector<uint32_t>::iterator it = thread_ids_.begin();
+      it != thread_ids_.end(); ++it) {
+    AddStream(new MemAddrStream(files, *it, filter, pool_, DecodeDepth(),
+        decoders == kStreaming, follow_, DecodeBytes()));
+  }
+}
+
+// Adds streams of threads whose chunks have appeared in a live trace.
+void MemAddrParser::AddNewThreads() {
+  std::vector<uint32_t> tids;
+  if (!ScanThreads(files_, &tids)) return;
+  for (std::vector<uint32_t>::iterator it = tids.begin(); it != tids.end();
+      ++it) {
+    if (std::find(thread_ids_.begin(), thread_ids_.end(), *it) !=
+        thread_ids_.end()) {
+      continue;
+    }
+    thread_ids_.push_back(*it);
+    AddStream(new MemAddrStream(files_, *it, filter_, pool_, DecodeDepth(),
+        decoders_ == kStreaming, follow_, DecodeBytes()));
+  }
+}
+
+// Whether the last segment has its index, which is written at the end.
+bool MemAddrParser::IsComplete() const {
+  FILE* file = fopen(files_.back().c_str(), "rb");
+  TraceHeader header;
+  uint64_t data_end;
+  const bool complete = file && MemAddrStream::ReadHeader(file, &header) &&
+      (header.version < 5 ||
+      MemAddrStream::ReadIndex(file, header, &data_end, NULL));
+  if (file) fclose(file);
+  return complete;
+}
+
+// Slots of each stream, which share the chunks ahead of the decoders.
+int MemAddrParser::DecodeDepth() const {
+  if (!pool_ || thread_ids_.empty()) return 1;
+  return 2 + kDecodeAhead * pool_->num_threads() / thread_ids_.size();
+}
+
+// Share of each stream in the slots of all. Threads announced later while
+// following take the share of as many streams as there are then.
+uint64_t MemAddrParser::DecodeBytes() const {
+  if (!pool_ || thread_ids_.empty()) return UINT64_MAX;
+  return kDecodeBytes / thread_ids_.size();
+}
+
+bool MemAddrParser::ListSegments(const char* file,
+    std::vector<std::string>* files) {
+  files->clear();
+  if (!TraceManifest::IsManifest(file)) {
+    files->push_back(file);
+    return true;
+  }
+  TraceManifest manifest;
+  if (!manifest.Load(file)) return false;
+  for (std::vector<TraceSegment>::iterator it = manifest.segments().begin();
+      it != manifest.segments().end(); ++it) {
+    files->push_back(it->file);
+  }
+  return !files->empty();
+}
+
+bool MemAddrParser::ScanThreads(const char* file, std::vector<uint32_t>* tids) {
+  std::vector<std::string> files;
+  return ListSegments(file, &files) && ScanThreads(files, tids);
+}
+
+bool MemAddrParser::ScanThreads(const std::vector<std::string>& files,
+    std::vector<uint32_t>* tids) {
+  std::set<uint32_t> found;
+  for (std::vector<std::string>::const_iterator it = files.begin();
+      it != files.end(); ++it) {
+    FILE* f = fopen(it->c_str(), "rb");
+    TraceHeader header;
+    if (!f || !MemAddrStream::ReadHeader(f, &header)) {
+      if (f) fclose(f);
+      return false;
+    }
+    uint64_t data_end;
+    std::vector<ChunkIndexEntry> entries;
+    if (MemAddrStream::ReadIndex(f, header, &data_end, &entries)) {
+      for (std::vector<ChunkIndexEntry>::iterator it = entries.begin();
+          it != entries.end(); ++it) {
+        found.insert(it->thread_id);
+      }
+    } else if (header.version > 0) {
+      ChunkHeader chunk;
+      while (MemAddrStream::SkipChunk(f, header, &chunk)) {
+        found.insert(chunk.thread_id);
+      }
+    } else {
+      found.insert(0); // legacy traces are a single stream
+    }
+    fclose(f);
+  }
+  tids->assign(found.begin(), found.end());
+  return true;
+}
+
+bool MemAddrParser::ScanIndex(const char* file, TraceExtent* extent) {
+  std::vector<std::string> files;
+  if (!ListSegments(file, &files)) return false;
+  extent->first_ins = UINT64_MAX;
+  extent->last_ins = 0;
+  extent->num_writes = 0;
+  extent->buffer_length = 0;
+  extent->filter_line = 0;
+  extent->filter_entries = 0;
+  extent->addr_ranges.clear();
+  std::set<uint32_t> threads;
+  std::vector< std::pair<uint64_t, uint64_t> > ranges;
+  for (std::vector<std::string>::iterator it = files.begin();
+      it != files.end(); ++it) {
+    FILE* f = fopen(it->c_str(), "rb");
+    TraceHeader header;
+    uint64_t data_end;
+    std::vector<ChunkIndexEntry> entries;
+    const bool found = f && MemAddrStream::ReadHeader(f, &header) &&
+        header.version >= 6 && // of 64-bit instruction sequences
+        MemAddrStream::ReadIndex(f, header, &data_end, &entries);
+    if (f) fclose(f);
+    if (!found) return false;
+    extent->buffer_length =
+        std::max(extent->buffer_length, header.buffer_length);
+    extent->filter_line = std::max(extent->filter_line, header.filter_line);
+    extent->filter_entries =
+        std::max(extent->filter_entries, header.filter_entries);
+    for (std::vector<ChunkIndexEntry>::iterator e = entries.begin();
+        e != entries.end(); ++e) {
+      extent->first_ins = std::min(extent->first_ins, e->first_ins);
+      extent->last_ins = std::max(extent->last_ins, e->last_ins);
+      extent->num_writes += e->num_writes;
+      threads.insert(e->thread_id);
+      if (e->num_writes) ranges.push_back(std::make_pair(e->min_addr,
+          e->max_addr));
+    }
+  }
+  extent->num_threads = threads.size();
+
+  std::sort(ranges.begin(), ranges.end());
+  for (std::vector< std::pair<uint64_t, uint64_t> >::iterator it =
+      ranges.begin(); it != ranges.end(); ++it) {
+    if (!extent->addr_ranges.empty() &&
+        it->first <= extent->addr_ranges.back().second) {
+      extent->addr_ranges.back().second =
+          std::max(extent->addr_ranges.back().second, it->second);
+    } else {
+      extent->addr_ranges.push_back(*it);
+    }
+  }
+  return extent->first_ins <= extent->last_ins;
+}
+
+void MemAddrParser::AddStream(MemAddrStream* stream) {
+  buffer_count_ = std::max(buffer_count_, stream->buffer_count());
+  filter_line_ = std::max(filter_line_, stream->header().filter_line);
+  filter_entries_ =
+      std::max(filter_entries_, stream->header().filter_entries);
+  const int i = streams_.size();
+  streams_.push_back(stream);
+  heads_.push_back(MemRecord());
+  memset(&heads_[i], 0, sizeof(MemRecord)); // no later than any record
+  stalled_.push_back(false);
+  PushHead(i);
+}
+
+// Reads the next record of the stream into the heap. A live stream without
+// one stays in the heap by its last record, which is no later than the next.
+void MemAddrParser::PushHead(int i) {
+  stalled_[i] = !streams_[i]->Next(&heads_[i]);
+  if (stalled_[i] && !(follow_ && streams_[i]->is_live())) return;
+  heap_.push_back(i);
+  std::push_heap(heap_.begin(), heap_.end(), greater_);
+}
+
+bool MemAddrParser::Seek(uint64_t ins_seq) {
+  heap_.clear();
+  pending_ = -1;
+  for (unsigned int i = 0; i < streams_.size(); ++i) {
+    if (streams_[i]->Seek(ins_seq) || streams_[i]->is_live()) PushHead(i);
+  }
+  return !heap_.empty();
+}
+
+bool MemAddrParser::Restrict(const RecordRange& range) {
+  for (unsigned int i = 0; i < streams_.size(); ++i) {
+    streams_[i]->Restrict(range);
+  }
+  return Seek(range.ins_begin);
+}
+
+static uint64_t FileSize(const std::string& file) {
+  struct stat st;
+  return stat(file.c_str(), &st) ? 0 : st.st_size;
+}
+
+// Waits while the next record may come from a live stream that has not
+// read it yet, or while a live trace has no records to return.
+void MemAddrParser::Await() {
+  uint64_t size = FileSize(files_.back());
+  int idle_ms = 0;
+  while (true) {
+    if (!heap_.empty()) {
+      const int i = heap_.front();
+      if (!stalled_[i]) return;
+      std::pop_heap(heap_.begin(), heap_.end(), greater_);
+      heap_.pop_back();
+      streams_[i]->Refresh();
+      PushHead(i);
+      if (!stalled_[i] || !streams_[i]->is_live()) continue;
+    } else if (IsComplete()) {
+      AddNewThreads(); // which have written all chunks by now
+      if (heap_.empty()) return;
+      continue;
+    }
+    if (idle_ms >= idle_limit_ms_) {
+      GiveUp();
+      return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(kFollowPollMs));
+    const uint64_t grown = FileSize(files_.back());
+    idle_ms = grown == size ? idle_ms + kFollowPollMs : 0;
+    size = grown;
+    AddNewThreads();
+  }
+}
+
+// Stops following, and returns the records on file of stalled streams
+// before they end.
+void MemAddrParser::GiveUp() {
+  std::cerr << "[Warn] MemAddrParser gave up on " << files_.back()
+      << " after " << idle_limit_ms_ / 1000 << " s without growth."
+      << " The trace is truncated." << std::endl;
+  follow_ = false;
+  truncated_ = true;
+  std::vector<int> stalled;
+  std::vector<int> heap;
+  for (std::vector<int>::iterator it = heap_.begin(); it != heap_.end();
+      ++it) {
+    (stalled_[*it] ? stalled : heap).push_back(*it);
+  }
+  heap_.swap(heap);
+  std::make_heap(heap_.begin(), heap_.end(), greater_);
+  for (std::vector<int>::iterator it = stalled.begin(); it != stalled.end();
+      ++it) {
+    streams_[*it]->Refresh();
+    PushHead(*it);
+  }
+}
+
+bool MemAddrParser::Next(MemRecord* rec) {
+  if (pending_ >= 0) ReadPendingHead();
+  if (follow_) Await();
+  if (heap_.empty()) return false;
+  std::pop_heap(heap_.begin(), heap_.end(), greater_);
+  const int i = heap_.back();
+  heap_.pop_back();
+  *rec = heads_[i];
+  PushHead(i);
+  if (follow_) CountLate(&rec->ins_seq, 1);
 
 #ifdef STDOUT
   std::cout << rec->ins_seq << '\t' << rec->mem_addr << '\t'
       << rec->op << std::endl;
 #endif
-  return ++i_next_;
+  return true;
+}
+
+// The head of the top stream is taken back to start the batch, which runs
+// until the head of the next stream in the heap would come first.
+bool MemAddrParser::NextBatch(RecordBatch* batch) {
+  if (pending_ >= 0) ReadPendingHead();
+  if (follow_) Await();
+  if (heap_.empty()) return false;
+  std::pop_heap(heap_.begin(), heap_.end(), greater_);
+  const int i = heap_.back();
+  uint64_t ins_limit = UINT64_MAX;
+  if (heap_.size() > 1) {
+    const int j = heap_.front();
+    ins_limit = heads_[j].ins_seq;
+    if (i < j && ins_limit < UINT64_MAX) ++ins_limit; // wins ties
+  }
+  streams_[i]->Unget();
+  BUG_ON(!streams_[i]->NextBatch(ins_limit, batch));
+  if (follow_) CountLate(batch->ins_seqs, batch->size);
+  // Reading the next head may reuse the buffers of the batch.
+  heap_.pop_back();
+  pending_ = i;
+  return true;
+}
+
+void MemAddrParser::ReadPendingHead() {
+  const int i = pending_;
+  pending_ = -1;
+  PushHead(i);
+}
+
+// Records of a stream are in order, so only its first ones can be late.
+void MemAddrParser::CountLate(const uint64_t* ins_seqs, uint32_t n) {
+  num_late_ += std::lower_bound(ins_seqs, ins_seqs + n, last_ins_) -
+      ins_seqs;
+  last_ins_ = std::max(last_ins_, ins_seqs[n - 1]);
 }
 
@@ -8,8 +8,18 @@
 #include <cstdlib>
 #include <cstdio>
 #include <cassert>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 #include "zlib.h"
+#include "mem_addr_format.h"
+#include "mem_addr_codec.h"
+#include "mem_addr_manifest.h"
 
 #ifdef NDEBUG
 #define BUG_ON(v) do { \
@@ -25,50 +35,454 @@ struct MemRecord {
   char op;
 };
 
-class MemAddrParser {
+// Consecutive records as columns, which point into the buffers of the
+// parser and stay valid until it is called again.
+struct RecordBatch {
+  const uint64_t* ins_seqs;
+  const uint64_t* mem_addrs;
+  const char* ops;
+  uint32_t size;
+  uint32_t thread_id; // that made the records, or 0 in legacy traces
+};
+
+// Records of interest, which fall within both half-open ranges.
+// Chunks that the index shows to hold no such record are skipped as a
+// whole, but records are returned regardless of the range.
+struct RecordRange {
+  uint64_t ins_begin;
+  uint64_t ins_end;
+  uint64_t addr_begin;
+  uint64_t addr_end;
+
+  RecordRange() : ins_begin(0), ins_end(UINT64_MAX),
+      addr_begin(0), addr_end(UINT64_MAX) { }
+  bool Contains(uint64_t ins_seq, uint64_t mem_addr) const {
+    return ins_seq >= ins_begin && ins_seq < ins_end &&
+        mem_addr >= addr_begin && mem_addr < addr_end;
+  }
+  bool Overlaps(const ChunkIndexEntry& entry) const {
+    return entry.first_ins < ins_end && entry.last_ins >= ins_begin &&
+        entry.min_addr < addr_end && entry.max_addr >= addr_begin;
+  }
+};
+
+// What the chunk indexes of a trace tell about it without decompressing.
+struct TraceExtent {
+  uint64_t first_ins;
+  uint64_t last_ins;
+  uint64_t num_writes;
+  uint32_t num_threads;
+  uint32_t buffer_length; // records of a chunk at most
+  uint32_t filter_line; // as MemAddrParser::filter_line()
+  uint32_t filter_entries;
+  // Disjoint inclusive address ranges, in order, of the chunks with writes
+  std::vector< std::pair<uint64_t, uint64_t> > addr_ranges;
+};
+
+// Records to replay. Traces of version 3 and later store writes apart,
+// so kWritesOnly skips decompressing reads and the op bitmap altogether.
+enum RecordFilter {
+  kAllRecords,
+  kWritesOnly
+};
+
+class DecodePool;
+
+// Reads a block of a chunk piece by piece, inflating it on the way if it is
+// compressed by zlib. The block is read from a mapping, or else from a file.
+class BlockReader {
  public:
-  MemAddrParser(const char* file);
-  ~MemAddrParser();
+  BlockReader();
+  ~BlockReader();
+
+  // Starts a block of len bytes at the offset in the mapping if there is
+  // one, or else in the file.
+  void Reset(const Bytef* map, FILE* file, uint64_t offset, uint64_t len,
+      bool is_zlib);
+  // Returns the next byte, or -1 at the end of the block or on error.
+  int Get();
+  bool GetVarint(uint64_t* v, int max_bytes);
+
+  static const int kWindowBytes = 4096;
+
+ private:
+  BlockReader(const BlockReader&);
+  bool Fill();
+
+  z_stream zs_;
+  bool is_zlib_;
+  const Bytef* map_;
+  int fd_;
+  uint64_t offset_; // of the input left
+  uint64_t left_;
+  uint8_t in_[kWindowBytes]; // read from the file
+  uint8_t out_[kWindowBytes];
+  const uint8_t* next_;
+  const uint8_t* end_;
+};
+
+// Sequential reader of the chunks of one thread.
+// Legacy traces carry no thread tags and are read as a single stream.
+//
+// With a DecodePool, up to depth - 1 chunks are read ahead of the one being
+// returned and decoded by the pool, and they are returned in file order.
+// The depth is cut to as many slots as fit in max_bytes, but no less than
+// two. Slots are allocated as they are first needed. Without a pool, each
+// chunk is decoded on demand by the calling thread.
+//
+// When streaming, chunks are instead decoded kStreamWindow records at a
+// time, inflating their blocks incrementally. Memory is then independent
+// of the buffer length of the trace. Streaming takes traces of version 2
+// and later that are compressed by zlib or not at all.
+//
+// When following, a segment without an index is taken as still being
+// written. At its end, and at a chunk written only in part, Next() returns
+// false while the stream stays live, and Refresh() picks up what is added.
+class MemAddrStream {
+ public:
+  // Reads the chunks of the thread from the segments in order.
+  MemAddrStream(const std::vector<std::string>& files, uint32_t thread_id,
+      RecordFilter filter = kAllRecords, DecodePool* pool = NULL,
+      int depth = 1, bool streaming = false, bool follow = false,
+      uint64_t max_bytes = UINT64_MAX);
+  ~MemAddrStream();
 
   bool Next(MemRecord* rec);
-  uint32_t buffer_count() const { return buffer_count_; }
+  // Returns the following records with an ins_seq less than ins_limit,
+  // up to the end of the current chunk, or false if there are none.
+  bool NextBatch(uint64_t ins_limit, RecordBatch* batch);
+  // Steps back over the record last returned by Next().
+  void Unget() { assert(i_next_); --i_next_; }
+  // Positions the stream at its first record with an ins_seq no less than
+  // the given one, using the chunk index if every segment has one.
+  // Returns false if there is no such record.
+  bool Seek(uint64_t ins_seq);
+  // Skips chunks without records in the range from now on, as far as
+  // every segment has an index.
+  void Restrict(const RecordRange& range);
+  // Catches up with the segment being written, if following.
+  void Refresh();
+  bool is_open() const { return file_; }
+  // Whether more records may come after Next() returns false
+  bool is_live() const { return follow_ && file_ && !complete_; }
+  uint32_t buffer_count() const { return header_.buffer_length; }
+  uint32_t version() const { return header_.version; }
+  const TraceHeader& header() const { return header_; }
+  const BlockCodec& codec() const { return codec_; }
+
+  // Fills in the header of a trace of any version and
+  // leaves the file positioned at the first chunk.
+  static bool ReadHeader(FILE* file, TraceHeader* header);
+  // Finds where the chunks end, which is the end of the file if it has
+  // no index, and reads the index entries if asked to. Returns whether
+  // there is an index. Leaves the file position unchanged.
+  static bool ReadIndex(FILE* file, const TraceHeader& header,
+      uint64_t* data_end, std::vector<ChunkIndexEntry>* entries);
+  // Reads the header of the next chunk and skips over its data.
+  static bool SkipChunk(FILE* file, const TraceHeader& header,
+      ChunkHeader* chunk);
+
+  static const uint32_t kStreamWindow = 4096;
 
  private:
+  friend class DecodePool;
+
+  // A chunk read from file, with the columns decoded from it.
+  struct Slot {
+    ChunkHeader chunk;
+    // Compressed blocks, in the mapping or in comps
+    std::vector<const Bytef*> blocks;
+    std::vector<Bytef*> comps; // allocated as blocks are read without mapping
+    std::vector<uint64_t> lens;
+    std::vector<uint64_t> offsets; // in the segment, when streaming
+    uint64_t* ins_array;
+    char* addr_array; // 64-bit addresses once a chunk is decoded
+    char* op_array;
+    Bytef* raw; // transformed columns before decoding
+    uint64_t* part_ins; // write and read streams before merging
+    char* part_addr;
+    uint8_t* bitmap;
+    uint32_t size; // of the decoded columns
+    bool busy; // being decoded by the pool, guarded by its mutex
+  };
+
+  // Position in the ins block and addr planes of a stream of records
+  struct StreamCursor {
+    int block;
+    uint32_t left;
+    uint64_t ins;
+    uint64_t addr;
+  };
+
+  struct IndexedChunk {
+    size_t segment;
+    ChunkIndexEntry entry;
+    bool skipped; // out of the range restricted to
+
+    static bool EndsBefore(const IndexedChunk& chunk, uint64_t ins_seq) {
+      return chunk.entry.last_ins < ins_seq;
+    }
+    static bool Precedes(const IndexedChunk& chunk,
+        const IndexedChunk& other) {
+      return chunk.segment < other.segment ||
+          (chunk.segment == other.segment &&
+          chunk.entry.offset < other.entry.offset);
+    }
+  };
+
+  static bool SkipBlocks(FILE* file, int num_blocks);
   bool Replenish();
+  void ReadAhead();
+  void Drain();
+  bool ReadChunk(Slot* slot);
+  bool LoadChunk(Slot* slot);
+  bool OpenSegment(size_t i);
+  bool OpenNextSegment();
+  void CloseSegment();
+  void MapSegment();
+  uint64_t Tell() const;
+  bool SetPos(uint64_t pos);
+  bool ReadBytes(void* dst, size_t bytes);
+  bool SkipBytes(uint64_t bytes);
+  bool LoadBlock(Slot* slot, int block);
+  const uint8_t* Inflate(const Slot& slot, int block, uint8_t* dst,
+      size_t* len) const;
+  bool LoadIndex();
+  void ExtendIndex();
+  bool IsWanted(const ChunkHeader& chunk, uint64_t offset) const;
+  bool IsBlockNeeded(int block) const;
+  bool CanStream() const;
+  bool BeginChunk();
+  void BeginCursor(StreamCursor* cursor, int block, uint32_t n);
+  uint32_t StreamWindow();
+  void StreamRecord(StreamCursor* cursor, uint32_t i);
+  Slot* NewSlot() const;
+  uint64_t SlotBytes() const;
+  static void DeleteSlot(Slot* slot);
+  void Decode(Slot* slot) const;
+  uint32_t DecodeRaw(Slot* slot) const;
+  uint32_t DecodeTransformed(Slot* slot) const;
+  uint32_t DecodeSplit(Slot* slot) const;
+  void DecodeStream(const Slot& slot, int block, uint32_t n,
+      uint64_t base_ins, uint64_t* ins, char* addrs) const;
+  void ExtendIns(uint32_t n);
+  void WidenAddrs(uint32_t n);
+  uint32_t CompactWrites(uint32_t n);
   void Close();
 
+  const std::vector<std::string> files_;
+  size_t next_file_;
   FILE* file_;
-  uint32_t buffer_count_;
-  uint32_t ptr_bytes_;
+  const char* map_; // the current segment if mapped, or NULL to fread
+  uint64_t map_size_;
+  uint64_t pos_; // in the mapping
+  uint64_t data_end_; // of the chunks in the current segment
+  TraceHeader header_;
+  BlockCodec codec_;
+  const uint32_t thread_id_; // ignored for legacy traces
+  const RecordFilter filter_;
+  DecodePool* const pool_;
+  int depth_;
+  bool streaming_;
+  const bool follow_;
+  bool complete_; // whether the current segment has an index
 
   uint32_t i_next_;
   uint32_t i_limit_;
-  uint32_t* ins_array_;
+  uint64_t* ins_array_; // columns of the current slot
   char* addr_array_;
   char* op_array_;
-  Bytef* ins_comp_;
-  Bytef* addr_comp_;
-  Bytef* op_comp_;
+  std::vector<size_t> bounds_;
+  size_t raw_bytes_;
+
+  std::vector<Slot*> slots_; // all owned
+  Slot* current_; // whose records are returned, or NULL
+  std::deque<Slot*> ahead_; // read after the current one, in file order
+  std::vector<Slot*> free_;
+
+  // When streaming, the window of records decoded from current_
+  std::vector<uint64_t> window_ins_;
+  std::vector<uint64_t> window_addrs_;
+  std::vector<char> window_ops_;
+  std::vector<BlockReader*> readers_; // of each block
+  StreamCursor cursors_[2]; // of writes and reads, or of all records
+  uint32_t chunk_left_; // records not yet streamed from current_
+  uint8_t bits_; // of the op bitmap not yet used
 
-  uint64_t base_ins_;
+  uint64_t base_ins_; // of 32-bit instruction sequences before version 6
   uint64_t base_step_;
   uint64_t last_ins_;
+
+  bool index_loaded_;
+  std::vector<IndexedChunk> index_; // of this thread, empty if incomplete
+  bool restricted_; // whether index_ marks chunks to skip
 };
 
-inline MemAddrParser::~MemAddrParser() {
+// Replays a trace either as one stream merged by instruction sequence,
+// or as the stream of a single thread. The file is either a trace or the
+// manifest of a segmented trace, whose segments are read in turn.
+//
+// With decoders greater than 0, chunks are decoded ahead in parallel by that
+// many threads. Streams read up to kDecodeAhead chunks per decoder ahead
+// between them, as far as their slots fit in kDecodeBytes. Each stream
+// still holds at least two chunks. With kStreaming as decoders, chunks are
+// streamed instead (see MemAddrStream).
+//
+// With follow, the trace may still be written, and Next() waits for more
+// records until its index is written at the end. A thread that has not
+// written its next records holds back records of other threads that may
+// come after them. Writers announce a thread with an empty chunk when it
+// starts, from which on it holds back others. Records written before the
+// announcement may still come after an earlier record of the new thread,
+// as threads are ordered only up to the instructions they count on their
+// own. Records that come earlier than ones already returned are late.
+// Once the trace has not grown for the idle limit, e.g., as its writer was
+// killed, following gives up, and the records on file end it as truncated.
+// Only a single trace file is followed, as a manifest lists closed segments.
+class MemAddrParser {
+ public:
+  MemAddrParser(const char* file, RecordFilter filter = kAllRecords,
+      int decoders = 0, bool follow = false);
+  // Replays only the given segments, e.g., a share of a worker thread.
+  MemAddrParser(const std::vector<std::string>& files,
+      RecordFilter filter = kAllRecords, int decoders = 0);
+  MemAddrParser(const char* file, uint32_t thread_id,
+      RecordFilter filter = kAllRecords, int decoders = 0);
+  ~MemAddrParser();
+
+  bool Next(MemRecord* rec);
+  // Returns the following records in the same order as Next() does, as
+  // many as come in a row from the same thread and chunk.
+  bool NextBatch(RecordBatch* batch);
+  // Skips to the first record with an ins_seq no less than the given one.
+  bool Seek(uint64_t ins_seq);
+  // Seeks to the beginning of the range, and skips chunks out of the range
+  // from there on (see RecordRange). Records out of the range may still be
+  // returned, and are left to the caller to filter out.
+  bool Restrict(const RecordRange& range);
+  uint32_t buffer_count() const { return buffer_count_; }
+  // Line bytes of the filter repeats are dropped by, or 0 (see LineFilter)
+  uint32_t filter_line() const { return filter_line_; }
+  uint32_t filter_entries() const { return filter_entries_; }
+  const std::vector<uint32_t>& thread_ids() const { return thread_ids_; }
+  // Records returned with an earlier ins_seq than one before, if followed
+  uint64_t num_late() const { return num_late_; }
+  // Whether following gave up before the trace was complete
+  bool truncated() const { return truncated_; }
+  void set_idle_limit_ms(int ms) { idle_limit_ms_ = ms; }
+
+  // Lists the segment files of a trace, which is only the file itself
+  // unless it is a manifest.
+  static bool ListSegments(const char* file, std::vector<std::string>* files);
+  // Lists the threads that have chunks in a trace.
+  static bool ScanThreads(const char* file, std::vector<uint32_t>* tids);
+  static bool ScanThreads(const std::vector<std::string>& files,
+      std::vector<uint32_t>* tids);
+  // Sums up the chunk indexes of a trace. Returns false unless every
+  // segment has an index with 64-bit instruction sequences.
+  static bool ScanIndex(const char* file, TraceExtent* extent);
+
+  static const int kDecodeAhead = 2;
+  static const uint64_t kDecodeBytes = 256 << 20; // of all streams' slots
+  static const int kDefaultDecoders = 2; // for tools
+  static const int kStreaming = -1;
+  static const int kFollowPollMs = 100;
+  static const int kFollowIdleMs = 60000;
+
+ private:
+  struct HeadGreater {
+    const std::vector<MemRecord>* heads;
+    bool operator()(int a, int b) const;
+  };
+
+  void Init(const std::vector<std::string>& files, RecordFilter filter,
+      int decoders);
+  int DecodeDepth() const;
+  uint64_t DecodeBytes() const;
+  void AddStream(MemAddrStream* stream);
+  void PushHead(int i);
+  void ReadPendingHead();
+  void CountLate(const uint64_t* ins_seqs, uint32_t n);
+  void Await();
+  void GiveUp();
+  void AddNewThreads();
+  bool IsComplete() const;
+
+  std::vector<std::string> files_;
+  RecordFilter filter_;
+  int decoders_;
+  bool follow_;
+  uint32_t buffer_count_;
+  uint32_t filter_line_;
+  uint32_t filter_entries_;
+  int pending_; // stream to read the head of after a batch, or -1
+  HeadGreater greater_;
+  std::vector<uint32_t> thread_ids_;
+  std::vector<MemAddrStream*> streams_;
+  std::vector<MemRecord> heads_; // next record of each stream
+  std::vector<int> heap_; // streams with pending heads, min-heap by ins_seq
+  // Streams in the heap by their last record, as they wait for the next
+  std::vector<bool> stalled_;
+  uint64_t last_ins_; // returned so far, if followed
+  uint64_t num_late_;
+  int idle_limit_ms_;
+  bool truncated_;
+  DecodePool* pool_;
+};
+
+inline int BlockReader::Get() {
+  if (next_ == end_ && !Fill()) return -1;
+  return *next_++;
+}
+
+// Threads that decode chunks read ahead by streams. Each chunk is decoded
+// by one thread, so decoding scales with the number of threads as long as
+// streams read far enough ahead.
+class DecodePool {
+ public:
+  explicit DecodePool(int num_threads);
+  // Waits for the threads, which finish the chunks already submitted.
+  ~DecodePool();
+
+  int num_threads() const { return threads_.size(); }
+
+ private:
+  friend class MemAddrStream;
+
+  struct Job {
+    const MemAddrStream* stream;
+    MemAddrStream::Slot* slot;
+  };
+
+  void Run();
+  void Submit(const MemAddrStream* stream, MemAddrStream::Slot* slot);
+  // Waits until the slot is decoded.
+  void Wait(const MemAddrStream::Slot* slot);
+
+  std::mutex mutex_; // guards all below and the busy flags of slots
+  std::condition_variable work_cond_;
+  std::condition_variable done_cond_;
+  std::deque<Job> queue_;
+  bool stopping_;
+  std::vector<std::thread> threads_;
+};
+
+inline MemAddrStream::~MemAddrStream() {
   Close();
 }
 
-inline void MemAddrParser::Close() {
-  if (!file_) return;
-  fclose(file_);
-  file_ = NULL;
-  delete[] ins_array_;
-  delete[] addr_array_;
-  delete[] op_array_;
-  free(ins_comp_);
-  free(addr_comp_);
-  free(op_comp_);
+inline MemAddrParser::~MemAddrParser() {
+  for (std::vector<MemAddrStream*>::iterator it = streams_.begin();
+      it != streams_.end(); ++it) {
+    delete *it;
+  }
+  delete pool_; // after the streams have drained their chunks
+}
+
+inline bool MemAddrParser::HeadGreater::operator()(int a, int b) const {
+  const MemRecord& ra = (*heads)[a];
+  const MemRecord& rb = (*heads)[b];
+  return ra.ins_seq > rb.ins_seq || (ra.ins_seq == rb.ins_seq && a > b);
 }
 
 #endif // SEXAIN_MEM_ADDR_PARSER_H_
@@ -3,51 +3,588 @@
 
 #include "mem_addr_trace.h"
 
-MemAddrTrace::MemAddrTrace(uint32_t buf_len, const char* file, uint32_t max_mb):
-    buf_len_(buf_len), end_(0) {
-  file_ = fopen(file, "wb");
-  fwrite(&buf_len_, sizeof(buf_len_), 1, file_);
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+static inline uint64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-  uint32_t ptr_bytes = sizeof(void*);
-  fwrite(&ptr_bytes, sizeof(ptr_bytes), 1, file_);
+// TraceFile
 
+TraceFile::TraceFile(uint32_t buf_len, const char* file, uint32_t max_mb,
+    int num_buffers, const BlockCodec& codec, uint32_t max_segments,
+    uint32_t ring_mb, const LineFilter& filter,
+    const LineFilter& noted_filter) :
+    buf_len_(buf_len), num_buffers_(num_buffers), codec_(codec),
+    path_(file), max_segments_(ring_mb ? 1 : max_segments),
+    ring_size_((uint64_t)ring_mb << 20), filter_(filter),
+    noted_filter_(noted_filter), sink_(NULL),
+    file_(NULL), full_(false),
+    workers_(0), in_flight_(0), stopping_(false), forking_(false),
+    forked_(false), ring_bytes_(0), dropped_chunks_(0),
+    dropped_oversize_(0) {
+  assert(num_buffers_ > 0);
+  BUG_ON(!codec_.is_available());
+  memset(&stats_, 0, sizeof(stats_));
   set_file_size(max_mb);
-  ins_array_ = new uint32_t[buf_len_];
-  addr_array_ = new void*[buf_len_];
-  op_array_ = new char[buf_len_];
-  ins_compressed_ = malloc(compressBound(sizeof(uint32_t) * buf_len_));
-  addr_compressed_ = malloc(compressBound(sizeof(void*) * buf_len_));
-  op_compressed_ = malloc(compressBound(sizeof(char) * buf_len_));
+  manifest_.segments().push_back(TraceSegment());
+  manifest_.segments().back().file = SegmentName(0);
+  if (!is_ring()) OpenSegment();
 }
 
-// Should be protected by lock for multi-threading
-bool MemAddrTrace::Flush() {
-  BUG_ON(end_ > buf_len_);
-  if (end_ == 0) return true;
-  if (!file_ || (uint64_t)ftell(file_) > file_size_) return false;
+TraceFile::TraceFile(uint32_t buf_len, RecordSink* sink, int num_buffers) :
+    buf_len_(buf_len), num_buffers_(num_buffers), max_segments_(1),
+    ring_size_(0), sink_(sink), file_(NULL), full_(false),
+    workers_(0), in_flight_(0), stopping_(false), forking_(false),
+    forked_(false), ring_bytes_(0), dropped_chunks_(0),
+    dropped_oversize_(0) {
+  assert(num_buffers_ > 0 && sink_);
+  memset(&stats_, 0, sizeof(stats_));
+  set_file_size(0);
+}
+
+// Does not wait for writer threads, which do not survive fork.
+TraceFile::~TraceFile() {
+  if (file_) fclose(file_);
+  for (std::vector<Scratch*>::iterator it = scratches_.begin();
+      it != scratches_.end(); ++it) {
+    delete *it;
+  }
+}
+
+void TraceFile::Run() {
+  Scratch scratch(buf_len_, codec_);
+  std::unique_lock<std::mutex> lock(mutex_);
+  ++workers_;
+  while (true) {
+    while (queue_.empty() && !stopping_) cond_.wait(lock);
+    if (queue_.empty()) break;
+    RecordBuffer* buffer = queue_.front();
+    queue_.pop_front();
+    lock.unlock();
+    Process(buffer, &scratch);
+    lock.lock();
+  }
+  --workers_;
+  cond_.notify_all();
+}
+
+void TraceFile::Stop() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  stopping_ = true;
+  cond_.notify_all();
+}
+
+void TraceFile::Sync() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (in_flight_) cond_.wait(lock);
+}
+
+void TraceFile::BeforeFork() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  forking_ = true;
+  while (in_flight_) cond_.wait(lock);
+  lock.release(); // held until after the fork
+  file_lock_.lock();
+}
+
+void TraceFile::AfterForkInParent() {
+  file_lock_.unlock();
+  forking_ = false;
+  cond_.notify_all();
+  mutex_.unlock();
+}
+
+void TraceFile::AfterForkInChild() {
+  file_lock_.unlock();
+  forking_ = false;
+  forked_ = true;
+  workers_ = 0;
+  mutex_.unlock();
+}
+
+void TraceFile::Abandon() {
+  BUG_ON(!forked_);
+  if (file_) fclose(file_);
+  file_ = NULL;
+  full_ = true;
+  for (std::vector<Scratch*>::iterator it = scratches_.begin();
+      it != scratches_.end(); ++it) {
+    delete *it;
+  }
+  scratches_.clear();
+  queue_.clear();
+  ring_.clear();
+  index_.clear();
+}
+
+void TraceFile::Close() {
+  Stop();
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (in_flight_ || workers_) cond_.wait(lock);
+  lock.unlock();
 
-  uLong len;
+  std::lock_guard<std::mutex> guard(file_lock_);
+  if (sink_) {
+    full_ = true;
+    return;
+  }
+  if (is_ring() && !full_) {
+    full_ = true;
+    if (!DumpRing(path_)) {
+      std::cerr << "[Error] TraceFile failed to dump " << path_ << std::endl;
+    }
+    return;
+  }
+  if (!file_) return;
+  WriteIndex();
+  fclose(file_);
+  file_ = NULL;
+  full_ = true;
+  if (is_segmented() && !manifest_.Save((path_ + ".manifest").c_str())) {
+    std::cerr << "[Error] TraceFile failed to save manifest of "
+        << path_ << std::endl;
+  }
+}
+
+bool TraceFile::Dump(const std::string& file) {
+  std::lock_guard<std::mutex> guard(file_lock_);
+  return DumpRing(file);
+}
+
+TraceStats TraceFile::stats() {
+  TraceStats stats;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stats = stats_;
+  }
+  std::lock_guard<std::mutex> guard(file_lock_);
+  stats.dropped_chunks = dropped_chunks_;
+  return stats;
+}
+
+void TraceFile::Submit(RecordBuffer* buffer) {
+  buffer->submit_ns = NowNs();
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (forking_) cond_.wait(lock);
+  ++in_flight_;
+  if (workers_) {
+    queue_.push_back(buffer);
+    cond_.notify_all();
+    return;
+  }
+  lock.unlock();
+
+  Scratch* scratch = AcquireScratch();
+  Process(buffer, scratch);
+  ReleaseScratch(scratch);
+}
+
+RecordBuffer* TraceFile::Acquire(MemAddrTrace* owner) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (owner->free_.empty()) {
+    const uint64_t begin = NowNs();
+    while (owner->free_.empty()) cond_.wait(lock);
+    ++stats_.stalls;
+    stats_.stall_ns += NowNs() - begin;
+  }
+  RecordBuffer* buffer = owner->free_.back();
+  owner->free_.pop_back();
+  return buffer;
+}
+
+void TraceFile::Process(RecordBuffer* buffer, Scratch* scratch) {
+  const uint32_t n = buffer->end;
+  BUG_ON(n == 0 || n > buf_len_);
+  if (sink_) {
+    Consume(buffer);
+    return;
+  }
+
+  const char* ops = buffer->op_array;
+  uint32_t num_writes = 0;
+  uintptr_t min_addr = UINTPTR_MAX, max_addr = 0;
+  for (uint32_t i = 0; i < n; ++i) {
+    num_writes += (ops[i] == 'W');
+    const uintptr_t addr = (uintptr_t)buffer->addr_array[i];
+    min_addr = std::min(min_addr, addr);
+    max_addr = std::max(max_addr, addr);
+  }
+  memset(scratch->bitmap, 0, (n + 7) / 8);
+  uint32_t wi = 0, ri = num_writes;
+  for (uint32_t i = 0; i < n; ++i) {
+    uint32_t j;
+    if (ops[i] == 'W') {
+      scratch->bitmap[i >> 3] |= 1 << (i & 7);
+      j = wi++;
+    } else {
+      j = ri++;
+    }
+    scratch->ins_part[j] = buffer->ins_array[i];
+    scratch->addr_part[j] = buffer->addr_array[i];
+  }
 
-  len = compressBound(sizeof(uint32_t) * end_);
-  BUG_ON(compress((Bytef*)ins_compressed_, &len,
-      (Bytef*)ins_array_, sizeof(uint32_t) * end_) != Z_OK);
-  BUG_ON(fwrite(&len, sizeof(len), 1, file_) != 1);
-  BUG_ON(fwrite(ins_compressed_, 1, len, file_) != len);
+  uint64_t lens[kNumBlocks];
+  CompressBlock(scratch, 0, scratch->bitmap, (n + 7) / 8, lens);
+  const uint64_t base_ins = buffer->ins_array[0];
+  int block = EncodeStream(scratch, 1, scratch->ins_part, base_ins,
+      scratch->addr_part, num_writes, lens);
+  block = EncodeStream(scratch, block, scratch->ins_part + num_writes,
+      base_ins, scratch->addr_part + num_writes, n - num_writes, lens);
+  assert(block == kNumBlocks);
 
-  len = compressBound(sizeof(void*) * end_);
-  BUG_ON(compress((Bytef*)addr_compressed_, &len,
-      (Bytef*)addr_array_, sizeof(void*) * end_) != Z_OK);
-  BUG_ON(fwrite(&len, sizeof(len), 1, file_) != 1);
-  BUG_ON(fwrite(addr_compressed_, 1, len, file_) != len);
+  // Chunks of the same thread have to stay in order on file.
+  MemAddrTrace* owner = buffer->owner;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (owner->appended_seq_ != buffer->seq) cond_.wait(lock);
+  lock.unlock();
 
-  len = compressBound(sizeof(char) * end_);
-  BUG_ON(compress((Bytef*)op_compressed_, &len,
-      (Bytef*)op_array_, sizeof(char) * end_) != Z_OK);
-  BUG_ON(fwrite(&len, sizeof(len), 1, file_) != 1);
-  BUG_ON(fwrite(op_compressed_, 1, len, file_) != len);
+  ChunkHeader chunk;
+  chunk.thread_id = owner->thread_id();
+  chunk.num_records = n;
+  chunk.num_writes = num_writes;
+  chunk.reserved = 0;
+  chunk.base_ins = base_ins;
+  ChunkIndexEntry entry;
+  entry.offset = 0; // set on append
+  entry.first_ins = buffer->ins_array[0];
+  entry.last_ins = buffer->ins_array[n - 1];
+  entry.thread_id = chunk.thread_id;
+  entry.num_records = n;
+  entry.num_writes = num_writes;
+  entry.reserved = 0;
+  entry.min_addr = min_addr;
+  entry.max_addr = max_addr;
+  const bool ok = Append(chunk, entry, scratch->blocks, lens);
+  const uint64_t latency = NowNs() - buffer->submit_ns;
 
+  lock.lock();
+  if (ok) {
+    ++stats_.chunks;
+    stats_.flush_ns += latency;
+    if (latency > stats_.max_flush_ns) stats_.max_flush_ns = latency;
+  } else {
+    full_ = true;
+  }
+  Release(buffer);
+}
+
+void TraceFile::Consume(RecordBuffer* buffer) {
+  MemAddrTrace* owner = buffer->owner;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (owner->appended_seq_ != buffer->seq) cond_.wait(lock);
+  lock.unlock();
+
+  bool ok = false;
+  {
+    std::lock_guard<std::mutex> guard(file_lock_);
+    if (!full_) {
+      sink_->Consume(owner->thread_id(), buffer->ins_array,
+          buffer->addr_array, buffer->op_array, buffer->end);
+      ok = true;
+    }
+  }
+  const uint64_t latency = NowNs() - buffer->submit_ns;
+
+  lock.lock();
+  if (ok) {
+    ++stats_.chunks;
+    stats_.flush_ns += latency;
+    if (latency > stats_.max_flush_ns) stats_.max_flush_ns = latency;
+  }
+  Release(buffer);
+}
+
+// Returns the buffer to its owner. Requires mutex_ held.
+void TraceFile::Release(RecordBuffer* buffer) {
+  MemAddrTrace* owner = buffer->owner;
+  ++owner->appended_seq_;
+  buffer->end = 0;
+  owner->free_.push_back(buffer);
+  --in_flight_;
+  cond_.notify_all();
+}
+
+// Writes a chunk without records for a thread that starts, so that a
+// reader following the file waits for its records from then on. It is
+// left out of the index, as is the thread if it never writes a record.
+void TraceFile::Announce(uint32_t thread_id) {
+  if (sink_ || is_ring()) return;
+  ChunkHeader chunk;
+  memset(&chunk, 0, sizeof(chunk));
+  chunk.thread_id = thread_id;
+  const char empty = 0;
+  std::vector<char> block(codec_.Bound(0) + 1);
+  size_t len = block.size();
+  BUG_ON(!codec_.Compress(block.data(), &len, &empty, 0));
+  const uint64_t block_len = len;
+
+  std::lock_guard<std::mutex> guard(file_lock_);
+  if (!file_ || full_) return;
+  BUG_ON(fwrite(&chunk, sizeof(chunk), 1, file_) != 1);
+  for (int i = 0; i < kNumBlocks; ++i) {
+    BUG_ON(fwrite(&block_len, sizeof(block_len), 1, file_) != 1);
+    BUG_ON(fwrite(block.data(), 1, len, file_) != len);
+  }
   fflush(file_);
-  end_ = 0;
+}
+
+// Returns the block following the stream.
+int TraceFile::EncodeStream(Scratch* scratch, int block, const uint64_t* ins,
+    uint64_t base_ins, void* const addrs[], uint32_t n,
+    uint64_t lens[]) const {
+  const size_t ins_bytes = EncodeInsColumn(ins, n, base_ins, scratch->raw);
+  CompressBlock(scratch, block++, scratch->raw, ins_bytes, lens);
+
+  EncodeAddrColumn(addrs, n, sizeof(void*), scratch->raw);
+  for (unsigned int b = 0; b < sizeof(void*); ++b) {
+    CompressBlock(scratch, block++, scratch->raw + (size_t)b * n, n, lens);
+  }
+  return block;
+}
+
+void TraceFile::CompressBlock(Scratch* scratch, int block,
+    const void* data, size_t bytes, uint64_t lens[]) const {
+  size_t len = scratch->bounds[block];
+  BUG_ON(!codec_.Compress(scratch->blocks[block], &len, data, bytes));
+  lens[block] = len;
+}
+
+bool TraceFile::Append(const ChunkHeader& chunk, const ChunkIndexEntry& entry,
+    void* const blocks[], const uint64_t lens[]) {
+  std::lock_guard<std::mutex> guard(file_lock_);
+  if (is_ring()) {
+    return AppendToRing(chunk, entry, blocks, lens);
+  }
+  if (!file_) return false;
+  if ((uint64_t)ftell(file_) > file_size_ && !Roll()) return false;
+
+  index_.push_back(entry);
+  index_.back().offset = ftell(file_);
+
+  BUG_ON(fwrite(&chunk, sizeof(chunk), 1, file_) != 1);
+  for (int i = 0; i < kNumBlocks; ++i) {
+    BUG_ON(fwrite(&lens[i], sizeof(lens[i]), 1, file_) != 1);
+    BUG_ON(fwrite(blocks[i], 1, lens[i], file_) != lens[i]);
+  }
+  fflush(file_);
+
+  TraceSegment& segment = manifest_.segments().back();
+  segment.first_ins = std::min(segment.first_ins, entry.first_ins);
+  segment.last_ins = std::max(segment.last_ins, entry.last_ins);
+  segment.num_records += chunk.num_records;
+  return true;
+}
+
+// Keeps the chunk as it would be on file, reusing the memory of the oldest
+// chunks that no longer fit. A chunk larger than the whole ring is dropped.
+bool TraceFile::AppendToRing(const ChunkHeader& chunk,
+    const ChunkIndexEntry& entry, void* const blocks[],
+    const uint64_t lens[]) {
+  if (full_) return false;
+  size_t bytes = sizeof(chunk) + sizeof(lens[0]) * kNumBlocks;
+  for (int i = 0; i < kNumBlocks; ++i) {
+    bytes += lens[i];
+  }
+  if (bytes > ring_size_) {
+    if (!dropped_oversize_++) {
+      std::cerr << "[Warn] TraceFile dropped a chunk of " << bytes
+          << " bytes, more than the ring holds. Use a larger ring or "
+          << "shorter buffers." << std::endl;
+    }
+    ++dropped_chunks_;
+    return true;
+  }
+
+  RingChunk recycled;
+  while (!ring_.empty() && ring_bytes_ + bytes > ring_size_) {
+    ring_bytes_ -= ring_.front().data.size();
+    recycled.data.swap(ring_.front().data);
+    ring_.pop_front();
+    ++dropped_chunks_;
+  }
+  ring_.push_back(RingChunk());
+  RingChunk& slot = ring_.back();
+  slot.data.swap(recycled.data);
+  slot.data.resize(bytes);
+  ring_bytes_ += bytes;
+
+  slot.entry = entry;
+
+  char* out = slot.data.data();
+  memcpy(out, &chunk, sizeof(chunk));
+  out += sizeof(chunk);
+  for (int i = 0; i < kNumBlocks; ++i) {
+    memcpy(out, &lens[i], sizeof(lens[i]));
+    out += sizeof(lens[i]);
+    memcpy(out, blocks[i], lens[i]);
+    out += lens[i];
+  }
   return true;
 }
 
+bool TraceFile::OpenSegment() {
+  file_ = OpenFile(manifest_.segments().back().file);
+  return file_ != NULL;
+}
+
+// Creates a trace file with its header written.
+FILE* TraceFile::OpenFile(const std::string& name) const {
+  FILE* file = fopen(name.c_str(), "wb");
+  if (!file) {
+    std::cerr << "[Error] TraceFile failed to open " << name << std::endl;
+    return NULL;
+  }
+
+  TraceHeader header;
+  header.magic = kTraceMagic;
+  header.version = kTraceVersion;
+  header.buffer_length = buf_len_;
+  header.ptr_bytes = sizeof(void*);
+  header.header_size = sizeof(header);
+  header.codec = codec_.id();
+  header.codec_level = codec_.level();
+  const LineFilter& noted = filter_.enabled() ? filter_ : noted_filter_;
+  header.filter_line = noted.line_bytes();
+  header.filter_entries = noted.entries();
+  BUG_ON(fwrite(&header, sizeof(header), 1, file) != 1);
+  fflush(file); // for readers following the trace
+  return file;
+}
+
+bool TraceFile::DumpRing(const std::string& file) {
+  BUG_ON(!is_ring() || file_);
+  file_ = OpenFile(file);
+  if (!file_) return false;
+  for (std::deque<RingChunk>::iterator it = ring_.begin(); it != ring_.end();
+      ++it) {
+    index_.push_back(it->entry);
+    index_.back().offset = ftell(file_);
+    BUG_ON(fwrite(it->data.data(), 1, it->data.size(), file_) !=
+        it->data.size());
+  }
+  WriteIndex();
+  bool ok = !ferror(file_);
+  ok = (fclose(file_) == 0) && ok;
+  file_ = NULL;
+  return ok;
+}
+
+void TraceFile::WriteIndex() {
+  IndexTrailer trailer;
+  trailer.index_offset = ftell(file_);
+  trailer.num_entries = index_.size();
+  trailer.entry_size = sizeof(ChunkIndexEntry);
+  trailer.magic = kIndexMagic;
+  if (!index_.empty()) {
+    BUG_ON(fwrite(index_.data(), sizeof(ChunkIndexEntry), index_.size(),
+        file_) != index_.size());
+  }
+  BUG_ON(fwrite(&trailer, sizeof(trailer), 1, file_) != 1);
+  fflush(file_); // marks the end to readers following the trace
+  index_.clear();
+}
+
+// Closes the current segment and continues in a new one.
+// The manifest on file lists the closed segments meanwhile.
+bool TraceFile::Roll() {
+  std::vector<TraceSegment>& segments = manifest_.segments();
+  if (!is_segmented() ||
+      (max_segments_ && segments.size() >= max_segments_)) {
+    return false;
+  }
+  WriteIndex();
+  fclose(file_);
+  file_ = NULL;
+  if (!manifest_.Save((path_ + ".manifest").c_str())) {
+    std::cerr << "[Warn] TraceFile failed to save manifest of "
+        << path_ << std::endl;
+  }
+  segments.push_back(TraceSegment());
+  segments.back().file = SegmentName(segments.size() - 1);
+  return OpenSegment();
+}
+
+std::string TraceFile::SegmentName(size_t i) const {
+  if (!is_segmented()) return path_;
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".%04lu.trace", (unsigned long)i);
+  return path_ + suffix;
+}
+
+TraceFile::Scratch* TraceFile::AcquireScratch() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (!scratches_.empty()) {
+      Scratch* scratch = scratches_.back();
+      scratches_.pop_back();
+      return scratch;
+    }
+  }
+  return new Scratch(buf_len_, codec_);
+}
+
+void TraceFile::ReleaseScratch(Scratch* scratch) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  scratches_.push_back(scratch);
+}
+
+// MemAddrTrace
+
+MemAddrTrace::MemAddrTrace(uint32_t buf_len, const char* file, uint32_t max_mb):
+    buf_len_(buf_len), file_(new TraceFile(buf_len, file, max_mb)),
+    owns_file_(true), thread_id_(0) {
+  Init();
+}
+
+MemAddrTrace::MemAddrTrace(TraceFile* file, uint32_t thread_id):
+    buf_len_(file->buffer_size()), file_(file),
+    owns_file_(false), thread_id_(thread_id), filter_(file->filter()) {
+  Init();
+}
+
+void MemAddrTrace::Init() {
+  next_seq_ = 0;
+  appended_seq_ = 0;
+  for (int i = 0; i < file_->num_buffers(); ++i) {
+    buffers_.push_back(new RecordBuffer(buf_len_, this));
+  }
+  free_.assign(buffers_.begin() + 1, buffers_.end());
+  Use(buffers_.front());
+  file_->Announce(thread_id_);
+}
+
+MemAddrTrace::~MemAddrTrace() {
+  {
+    std::unique_lock<std::mutex> lock(file_->mutex_);
+    // Buffers being handed off in the parent are never returned in a child.
+    while (free_.size() + 1 < buffers_.size() && !file_->forked_) {
+      file_->cond_.wait(lock);
+    }
+  }
+  for (std::vector<RecordBuffer*>::iterator it = buffers_.begin();
+      it != buffers_.end(); ++it) {
+    delete *it;
+  }
+  if (owns_file_) {
+    file_->Close();
+    delete file_;
+  }
+}
+
+bool MemAddrTrace::Flush() {
+  BUG_ON(end_ > buf_len_);
+  if (file_->full()) return false;
+  if (end_ == 0) return true;
+
+  current_->end = end_;
+  current_->seq = next_seq_++;
+  file_->Submit(current_);
+  Use(file_->Acquire(this));
+  filter_.Clear();
+  return !file_->full();
+}
+
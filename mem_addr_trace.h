@@ -4,10 +4,22 @@
 #ifndef SEXAIN_MEM_ADDR_TRACE_H_
 #define SEXAIN_MEM_ADDR_TRACE_H_
 
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include "zlib.h"
+#include "mem_addr_format.h"
+#include "mem_addr_codec.h"
+#include "mem_addr_manifest.h"
 
 #ifdef NDEBUG
 #define BUG_ON(v) do { \
@@ -17,44 +29,323 @@ while(0)
 #define BUG_ON(v) (assert(!(v)))
 #endif
 
-class MemAddrTrace {
+class MemAddrTrace;
+
+// Drops an access that repeats one of the recent accesses, i.e., one of the
+// same op to the same line. Recent lines are kept in a direct-mapped table,
+// so a repeat is dropped only while its line stays in the table, and until
+// the table is cleared.
+class LineFilter {
  public:
-  MemAddrTrace(uint32_t buf_len, const char* file, uint32_t max_size_mb); 
-  ~MemAddrTrace();
- 
-  bool Input(uint32_t ins_seq, void* addr, char op);
-  bool Flush();
+  // Entries are rounded up to a power of two. Zero disables the filter.
+  LineFilter(uint32_t line_bytes = 0, uint32_t entries = 0);
+
+  bool enabled() const { return !lines_.empty(); }
+  uint32_t line_bytes() const { return enabled() ? 1 << line_bits_ : 0; }
+  uint32_t entries() const { return lines_.size(); }
+  // Remembers the access and returns whether it repeats a recent one.
+  bool Repeats(void* addr, char op);
+  // Forgets all accesses, so the next access to each line is kept.
+  void Clear();
+
+ private:
+  int line_bits_;
+  uintptr_t mask_;
+  std::vector<uintptr_t> lines_; // line address with the write flag
+};
+
+// Records handed off by a MemAddrTrace to be compressed and written.
+struct RecordBuffer {
+  uint64_t* ins_array;
+  void** addr_array;
+  char* op_array;
+  uint32_t end;
+
+  MemAddrTrace* owner;
+  uint64_t seq; // order among the chunks of the owner
+  uint64_t submit_ns;
+
+  RecordBuffer(uint32_t len, MemAddrTrace* owner);
+  ~RecordBuffer();
+};
+
+// Receives the records of full buffers, in place of a trace on file.
+// Buffers of a thread arrive in order, and one at a time overall.
+class RecordSink {
+ public:
+  virtual ~RecordSink() { }
+  virtual void Consume(uint32_t thread_id, const uint64_t* ins,
+      void* const addrs[], const char* ops, uint32_t n) = 0;
+};
+
+// Overhead counters of a TraceFile.
+struct TraceStats {
+  uint64_t chunks;
+  uint64_t flush_ns; // from hand-off until the chunk is on file
+  uint64_t max_flush_ns;
+  uint64_t stalls; // hand-offs that waited for a free buffer
+  uint64_t stall_ns;
+  uint64_t dropped_chunks; // out of the ring
+};
+
+// Output file shared by the per-thread MemAddrTrace buffers.
+// Full buffers are compressed and appended by the threads calling Run().
+// Without any such writer thread, they are processed inline on hand-off.
+//
+// With max_segments other than 1, the trace rolls over to a new segment
+// file whenever the current one exceeds max_size_mb, instead of becoming
+// full. Segments are named file.0000.trace, file.0001.trace, ... and listed
+// in file.manifest, which is updated on every roll-over and on Close().
+// Up to max_segments are written, or without limit if it is 0.
+//
+// With ring_size_mb other than 0, the TraceFile is a flight recorder that
+// writes nothing on its own. It keeps the most recent compressed chunks up to
+// ring_size_mb in memory, dropping the oldest ones, and writes them out as a
+// normal trace on Dump() and on Close(). The file is then never full.
+// A chunk larger than ring_size_mb by itself is dropped right away.
+//
+// Records go through the filter before they are buffered. A trace of records
+// that went through a filter before, e.g., a slice of a filtered trace,
+// gives that one as noted_filter instead, which is only noted in the header.
+class TraceFile {
+ public:
+  TraceFile(uint32_t buf_len, const char* file, uint32_t max_size_mb,
+      int num_buffers = 1, const BlockCodec& codec = BlockCodec(),
+      uint32_t max_segments = 1, uint32_t ring_size_mb = 0,
+      const LineFilter& filter = LineFilter(),
+      const LineFilter& noted_filter = LineFilter());
+  // Hands the records to the sink instead of writing any file.
+  TraceFile(uint32_t buf_len, RecordSink* sink, int num_buffers = 1);
+  ~TraceFile();
+
+  // Serves as a writer thread until Stop() is called and work drains.
+  void Run();
+  // Lets writer threads exit once queued buffers are processed.
+  void Stop();
+  // Waits until all handed-off buffers are on file.
+  void Sync();
+  // Waits until all handed-off buffers are on file, and keeps new ones from
+  // being handed off and the file from being written until either call
+  // below, so no other thread holds a lock of the TraceFile over a fork.
+  void BeforeFork();
+  void AfterForkInParent();
+  // Lets go of the locks in the child, where only the forking thread is
+  // left. Buffers of MemAddrTraces are then freed without waiting.
+  void AfterForkInChild();
+  // Closes the file and frees the scratch space in the child, once its
+  // MemAddrTraces are gone. The TraceFile is then leaked, not deleted: its
+  // mutex and condition variable may still count waiters among the threads
+  // left behind by the fork, and destroying them would wait for those.
+  void Abandon();
+  // Stops writer threads, waits for them and all buffers, and finishes
+  // the file with its chunk index. Nothing is appended afterwards.
+  void Close();
+  // Writes the chunks in the ring to the given trace file.
+  bool Dump(const std::string& file);
 
   uint32_t buffer_size() const { return buf_len_; }
+  int num_buffers() const { return num_buffers_; }
+  const BlockCodec& codec() const { return codec_; }
+  // Prototype of the filter each MemAddrTrace applies to its records
+  const LineFilter& filter() const { return filter_; }
   FILE* file() const { return file_; }
+  bool full() const { return full_; }
+  bool is_segmented() const { return max_segments_ != 1; }
+  bool is_ring() const { return ring_size_ != 0; }
+  TraceStats stats();
 
   uint64_t file_size() const { return file_size_; }
   void set_file_size(uint32_t mb) { file_size_ = (uint64_t)mb << 20; }
 
+  // op bitmap, then ins and addr planes of writes and of reads
+  static const int kNumBlocks = 1 + 2 * (1 + sizeof(void*));
+
  private:
+  friend class MemAddrTrace;
+
+  struct Scratch {
+    uint64_t* ins_part; // writes first, then reads
+    void** addr_part;
+    uint8_t* bitmap;
+    uint8_t* raw; // transformed column before compression
+    void* blocks[kNumBlocks];
+    size_t bounds[kNumBlocks];
+    Scratch(uint32_t buf_len, const BlockCodec& codec);
+    ~Scratch();
+  };
+
+  void Submit(RecordBuffer* buffer);
+  RecordBuffer* Acquire(MemAddrTrace* owner);
+  void Process(RecordBuffer* buffer, Scratch* scratch);
+  void Consume(RecordBuffer* buffer);
+  void Release(RecordBuffer* buffer);
+  void Announce(uint32_t thread_id);
+  int EncodeStream(Scratch* scratch, int block, const uint64_t* ins,
+      uint64_t base_ins, void* const addrs[], uint32_t n,
+      uint64_t lens[]) const;
+  void CompressBlock(Scratch* scratch, int block,
+      const void* data, size_t bytes, uint64_t lens[]) const;
+  bool Append(const ChunkHeader& chunk, const ChunkIndexEntry& entry,
+      void* const blocks[], const uint64_t lens[]);
+  bool AppendToRing(const ChunkHeader& chunk, const ChunkIndexEntry& entry,
+      void* const blocks[], const uint64_t lens[]);
+  bool OpenSegment();
+  FILE* OpenFile(const std::string& name) const;
+  bool DumpRing(const std::string& file);
+  void WriteIndex();
+  bool Roll();
+  std::string SegmentName(size_t i) const;
+  Scratch* AcquireScratch();
+  void ReleaseScratch(Scratch* scratch);
+
   const uint32_t buf_len_;
+  const int num_buffers_; // per MemAddrTrace
+  const BlockCodec codec_;
+  const std::string path_;
+  const uint32_t max_segments_;
+  const uint64_t ring_size_; // in bytes
+  const LineFilter filter_;
+  const LineFilter noted_filter_; // not applied
+  RecordSink* const sink_;
   FILE* file_;
   uint64_t file_size_; // max file size
+  std::atomic<bool> full_;
+
+  std::mutex mutex_; // guards all below and the free lists of buffers
+  std::condition_variable cond_;
+  std::deque<RecordBuffer*> queue_;
+  std::vector<Scratch*> scratches_;
+  int workers_;
+  int in_flight_;
+  bool stopping_;
+  bool forking_; // while no buffer is handed off
+  bool forked_; // in the child, where no writer is left
+  TraceStats stats_;
+
+  std::mutex file_lock_; // guards the file and the manifest
+  TraceManifest manifest_; // the last segment is the current one
+  std::vector<ChunkIndexEntry> index_; // of the current segment
+
+  struct RingChunk {
+    ChunkIndexEntry entry; // offset to be set on dump
+    std::vector<char> data; // chunk header and blocks as on file
+  };
+  std::deque<RingChunk> ring_; // guarded by file_lock_
+  uint64_t ring_bytes_;
+  uint64_t dropped_chunks_;
+  uint64_t dropped_oversize_; // of the above, larger than the ring
+};
+
+// Record buffers of a single thread. Not thread-safe by itself:
+// each thread should own its MemAddrTrace.
+class MemAddrTrace {
+ public:
+  MemAddrTrace(uint32_t buf_len, const char* file, uint32_t max_size_mb);
+  MemAddrTrace(TraceFile* file, uint32_t thread_id);
+  ~MemAddrTrace(); // waits for buffers in flight
+
+  bool Input(uint64_t ins_seq, void* addr, char op);
+  // Hands off buffered records. Returns false once the file is full.
+  // The filter is cleared, so a chunk drops only repeats within itself.
+  bool Flush();
+  // Clears the filter, so a repeat of an access before is not dropped.
+  void ResetFilter() { filter_.Clear(); }
+
+  uint32_t buffer_size() const { return buf_len_; }
+  uint32_t thread_id() const { return thread_id_; }
+  TraceFile* trace_file() const { return file_; }
+
+ private:
+  friend class TraceFile;
+
+  void Init();
+  void Use(RecordBuffer* buffer);
+
+  const uint32_t buf_len_;
+  TraceFile* file_;
+  const bool owns_file_;
+  const uint32_t thread_id_;
   uint32_t end_;
-  uint32_t* ins_array_;
+  LineFilter filter_;
+  uint64_t* ins_array_;
   void** addr_array_;
   char* op_array_;
-  void* ins_compressed_;
-  void* addr_compressed_;
-  void* op_compressed_;
+
+  RecordBuffer* current_;
+  uint64_t next_seq_;
+  std::vector<RecordBuffer*> buffers_;
+  std::vector<RecordBuffer*> free_; // guarded by the TraceFile
+  uint64_t appended_seq_; // guarded by the TraceFile
 };
 
-inline MemAddrTrace::~MemAddrTrace() {
-  if (file_) fclose(file_);
-  delete[] ins_array_;
-  delete[] addr_array_;
-  delete[] op_array_;
-  free(ins_compressed_);
-  free(addr_compressed_);
-  free(op_compressed_);
+inline LineFilter::LineFilter(uint32_t line_bytes, uint32_t entries) :
+    line_bits_(0), mask_(0) {
+  if (!line_bytes || !entries) return;
+  while ((1u << line_bits_) < line_bytes) ++line_bits_;
+  uint32_t size = 1;
+  while (size < entries) size <<= 1;
+  mask_ = size - 1;
+  lines_.assign(size, UINTPTR_MAX);
+}
+
+inline bool LineFilter::Repeats(void* addr, char op) {
+  const uintptr_t tag =
+      ((uintptr_t)addr >> line_bits_ << 1) | (uintptr_t)(op == 'W');
+  uintptr_t& line = lines_[tag & mask_];
+  if (line == tag) return true;
+  line = tag;
+  return false;
+}
+
+inline void LineFilter::Clear() {
+  std::fill(lines_.begin(), lines_.end(), UINTPTR_MAX);
 }
 
-inline bool MemAddrTrace::Input(uint32_t ins_seq, void* addr, char op) {
+inline RecordBuffer::RecordBuffer(uint32_t len, MemAddrTrace* owner) :
+    end(0), owner(owner), seq(0), submit_ns(0) {
+  ins_array = new uint64_t[len];
+  addr_array = new void*[len];
+  op_array = new char[len];
+}
+
+inline RecordBuffer::~RecordBuffer() {
+  delete[] ins_array;
+  delete[] addr_array;
+  delete[] op_array;
+}
+
+inline TraceFile::Scratch::Scratch(uint32_t buf_len,
+    const BlockCodec& codec) {
+  const size_t raw_bytes = kMaxVarintBytes64 > sizeof(void*) ?
+      kMaxVarintBytes64 : sizeof(void*);
+  raw = new uint8_t[raw_bytes * buf_len];
+  ins_part = new uint64_t[buf_len];
+  addr_part = new void*[buf_len];
+  bitmap = new uint8_t[(buf_len + 7) / 8];
+
+  bounds[0] = codec.Bound((buf_len + 7) / 8);
+  for (int i = 1; i < kNumBlocks; ++i) {
+    bounds[i] = codec.Bound(sizeof(char) * buf_len);
+  }
+  bounds[1] = codec.Bound(kMaxVarintBytes64 * buf_len);
+  bounds[2 + sizeof(void*)] = bounds[1];
+  for (int i = 0; i < kNumBlocks; ++i) {
+    blocks[i] = malloc(bounds[i]);
+  }
+}
+
+inline TraceFile::Scratch::~Scratch() {
+  delete[] raw;
+  delete[] ins_part;
+  delete[] addr_part;
+  delete[] bitmap;
+  for (int i = 0; i < kNumBlocks; ++i) {
+    free(blocks[i]);
+  }
+}
+
+inline bool MemAddrTrace::Input(uint64_t ins_seq, void* addr, char op) {
+  if (filter_.enabled() && filter_.Repeats(addr, op)) return true;
   if (end_ == buf_len_ && !Flush()) {
     return false;
   }
@@ -66,5 +357,13 @@ inline bool MemAddrTrace::Input(uint32_t ins_seq, void* addr, char op) {
   return true;
 }
 
+inline void MemAddrTrace::Use(RecordBuffer* buffer) {
+  current_ = buffer;
+  ins_array_ = buffer->ins_array;
+  addr_array_ = buffer->addr_array;
+  op_array_ = buffer->op_array;
+  end_ = 0;
+}
+
 #endif // SEXAIN_MEM_ADDR_TRACE_H_
 
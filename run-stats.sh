@@ -2,14 +2,11 @@
 
 if [ $# -lt 5 ]; then
   echo "Usage: $0 FILE_PREFIX "\
-    "[-e EPOCH_INTERVAL]... [-p PAGE_BITS]..."
+    "[-e EPOCH_INTERVAL]... [-p PAGE_BITS]... [-j JOBS] [-m MEM_MIB]"
   exit 1 
 fi
 
 file_pre=$1
 
-files=`ls "$file_pre"*.trace`
-
-for file in $files; do
-  ./MemAddrStats.o $file ${@:2} 2>>err.log &
-done
+./MemAddrBatch.o "$file_pre*" ${@:2} -o "${file_pre}aggregate" \
+    2>>err.log
@@ -3,6 +3,7 @@
 if [ $# -ne 5 ]; then
   echo "Usage: $0 FILE_PREFIX"\
     "MIN_INTERVAL MAX_INTERVAL MIN_PAGE_BITS MAX_PAGE_BITS"
+  echo "Intervals go up tenfold from MIN_INTERVAL to MAX_INTERVAL."
   exit 1 
 fi
 
@@ -12,9 +13,13 @@ max_interval=$3
 min_bits=$4
 max_bits=$5
 
-files=`ls "$file_pre"*.trace`
-
-for file in $files; do
-  ./MemAddrStats.o $file $min_interval $max_interval $min_bits $max_bits \
-      2>>err.log &
+args=""
+for ((interval = min_interval; interval <= max_interval; interval *= 10)); do
+  args="$args -e $interval"
+done
+for ((bits = min_bits; bits <= max_bits; ++bits)); do
+  args="$args -p $bits"
 done
+
+./MemAddrBatch.o "$file_pre*" $args -o "${file_pre}aggregate" \
+    2>>err.log
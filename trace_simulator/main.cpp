@@ -11,8 +11,11 @@
 #include <fstream>
 #include <iomanip>
 #include <cassert>
+#include <string>
+#include <algorithm>
 
 #include "trace_simulator.h"
+#include "../mem_addr_parser.h"
 
 #define M (1000000)
 
@@ -25,6 +28,55 @@ void PrintStats(const TraceSimulator *ts) {
   cout << ts->BasicStats().dram_through() << endl;
 }
 
+// Binary traces of MemAddrTrace, as opposed to text dumps, by their header
+// whatever they are named. Legacy traces start with a buffer length and a
+// pointer width instead of the magic, which no line of hex text passes for.
+bool IsBinaryTrace(const char *filename) {
+  if (TraceManifest::IsManifest(filename)) return true;
+  FILE *file = fopen(filename, "rb");
+  if (!file) return false;
+  TraceHeader header;
+  const bool is_trace = MemAddrStream::ReadHeader(file, &header) &&
+      (header.magic == kTraceMagic ||
+      header.ptr_bytes == 4 || header.ptr_bytes == 8);
+  fclose(file);
+  return is_trace;
+}
+
+// Feeds the writes in the window to the simulators in batches. The chunk
+// index lets the parser start at the window without decoding the chunks
+// before it. Chunks are decoded on demand, as records are taken strictly
+// in order and many simulators tend to run side by side.
+int SimulateTrace(const char *filename, long long ins_begin,
+    long long ins_num, vector<TraceSimulator *> &simulators) {
+  MemAddrParser parser(filename, kWritesOnly, 0);
+  if (parser.thread_ids().empty()) {
+    cerr << "Failed to open " << filename << endl;
+    return ENFILE;
+  }
+  const uint64_t ins_end = ins_begin + ins_num;
+  uint64_t ins_progress = ins_begin + 10 * M;
+  RecordBatch batch;
+  if (ins_begin) parser.Seek(ins_begin);
+  while (parser.NextBatch(&batch)) {
+    const uint64_t *end = batch.ins_seqs + batch.size;
+    const bool is_last = end[-1] >= ins_end;
+    if (is_last) {
+      batch.size = lower_bound(batch.ins_seqs, end, ins_end) - batch.ins_seqs;
+    }
+    for (TraceSimulator *ts : simulators) {
+      ts->Put(batch.ins_seqs, batch.mem_addrs, batch.ops, batch.size,
+          ins_begin);
+    }
+    if (is_last) break;
+    if (end[-1] > ins_progress) {
+      cerr << filename << ": processing " << end[-1] / M << " M" << endl;
+      ins_progress += 10 * M;
+    }
+  }
+  return 0;
+}
+
 int main(int argc, const char * argv[]) {
   if (argc != 5) {
     cerr << "Wrong # arguments: " << argc << endl;
@@ -37,13 +89,6 @@ int main(int argc, const char * argv[]) {
   const long long ins_begin = atoi(argv[3]) * M;
   const long long ins_num = atoi(argv[4]) * M;
   
-  ifstream fin(filename);
-  if (!fin.is_open()) {
-    cerr << "Failed to open " << filename << endl;
-    return ENFILE;
-  }
-  fin >> hex;
-  
   vector<TraceSimulator *> simulators;
   for (int i = 3; i < 5; ++i) {
     simulators.push_back(new TraceSimulator(buf_len, 2  * i, false));
@@ -52,6 +97,22 @@ int main(int argc, const char * argv[]) {
     simulators.push_back(new TraceSimulator(buf_len, 2  * i, true));
   }
   
+  if (IsBinaryTrace(filename)) {
+    const int err = SimulateTrace(filename, ins_begin, ins_num, simulators);
+    if (err) return err;
+    for (TraceSimulator *ts : simulators) {
+      PrintStats(ts);
+    }
+    return 0;
+  }
+  
+  ifstream fin(filename);
+  if (!fin.is_open()) {
+    cerr << "Failed to open " << filename << endl;
+    return ENFILE;
+  }
+  fin >> hex;
+  
   long long ins_total = 0;
   long long ins_progress = 10 * M;
   while (!fin.eof()) {
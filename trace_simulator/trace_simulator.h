@@ -50,8 +50,8 @@ struct TagEqual {
 class TraceSimulator {
 public:
   TraceSimulator(int buffer_len, int block_bits, bool has_dram) :
-      buffer_slots_(buffer_len),
       block_bits_(block_bits),
+      buffer_slots_(buffer_len),
       free_queue_(buffer_slots_),
       clean_queue_(buffer_slots_),
       dirty_queue_(buffer_slots_),
@@ -83,6 +83,15 @@ public:
     }
   }
   
+  // Puts the writes among n records given as columns, e.g., a RecordBatch,
+  // counting instructions from ins_begin as text input does.
+  void Put(const uint64_t ins_seqs[], const uint64_t addrs[],
+      const char ops[], size_t n, uint64_t ins_begin) {
+    for (size_t i = 0; i < n; ++i) {
+      if (ops[i] == 'W') Put(addrs[i], ins_seqs[i] - ins_begin);
+    }
+  }
+  
   void RegisterStats(Stats &stats) { stats_.push_back(stats); }
   Stats BasicStats() const { return stats_.at(0); }
   
@@ -182,7 +191,7 @@ private:
   
   void CheckBufferNum() {
     if (free_queue_.length() + clean_queue_.length() + dirty_queue_.length() +
-        hidden_queue_.length() != buffer_slots_.size()) {
+        hidden_queue_.length() != (int)buffer_slots_.size()) {
       std::cerr << "Mismatch in buffer numbers: total=" << buffer_slots_.size();
       std::cerr << " free=" << free_queue_.length();
       std::cerr << " clean=" << clean_queue_.length();